@@ -0,0 +1,226 @@
+/*
+* Versioned, relocatable binary format for a finished room model, so the BSP does not have to be rebuilt on
+* every start. The file is a header followed by plain arrays (sections); everything refers to other data by
+* index, never by pointer, so the file can be mapped read-only at any address. The header carries a content
+* hash of everything the build depends on, a mismatch makes the loader fall back to building the room.
+* The room_model members save_bsp_cache / load_bsp_cache translate between the model and these sections.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "mapped_file.h"
+
+namespace rts {
+
+	// Bump whenever the layout or the meaning of a section changes
+	constexpr uint32_t BSP_CACHE_VERSION = 6;
+	constexpr char BSP_CACHE_MAGIC[8] = { 'R', 'T', 'S', 'B', 'S', 'P', 'C', '\0' };
+	// Files written on a machine with another byte order are rejected instead of converted
+	constexpr uint32_t BSP_CACHE_BYTE_ORDER = 0x01020304u;
+
+	enum bsp_cache_section_id : uint32_t {
+		// bsp_cache_wall per wall of pwalls_BSP, their corners as float triples
+		BSP_CACHE_WALLS,
+		BSP_CACHE_CORNERS,
+		// bsp_cache_node per node of flat_bsp_nodes and flat_bsp_wall_indices
+		BSP_CACHE_NODES,
+		BSP_CACHE_NODE_WALLS,
+		// Index lists (offsets with one extra end entry + wall indices) of plane_polygon_map, direct_reflectables
+		// and blockables of pwalls_BSP, and direct_reflectables of the walls_BSP copies (taken before the union step)
+		BSP_CACHE_PLANE_MAP_OFFSETS,
+		BSP_CACHE_PLANE_MAP_WALLS,
+		BSP_CACHE_REFLECTABLES_OFFSETS,
+		BSP_CACHE_REFLECTABLES,
+		BSP_CACHE_COPY_REFLECTABLES_OFFSETS,
+		BSP_CACHE_COPY_REFLECTABLES,
+		BSP_CACHE_BLOCKABLES_OFFSETS,
+		BSP_CACHE_BLOCKABLES,
+		// Potentially visible set rows of the cells, empty for rooms built without it
+		BSP_CACHE_CELL_PVS,
+		BSP_CACHE_SECTION_COUNT
+	};
+
+	struct bsp_cache_section {
+		uint64_t offset;
+		uint64_t count;
+	};
+
+	struct bsp_cache_header {
+		char magic[8];
+		uint32_t version;
+		uint32_t byte_order;
+		uint64_t content_hash;
+		int32_t tree_height;
+		uint32_t section_count;
+		bsp_cache_section sections[BSP_CACHE_SECTION_COUNT];
+	};
+
+	struct bsp_cache_wall {
+		uint32_t id;
+		uint32_t parent_id;
+		int32_t plane_polygon_map_id;
+		uint32_t corner_offset;
+		uint32_t corner_count;
+		uint32_t enabled;
+	};
+
+	struct bsp_cache_node {
+		uint32_t front;
+		uint32_t back;
+		uint32_t wall_offset;
+		uint32_t wall_count;
+		uint32_t leaf_node;
+	};
+
+	// 64 bit FNV-1a over everything the room model build depends on
+	class bsp_cache_hasher {
+	public:
+		void add(const void* data, const size_t size) {
+			const unsigned char* bytes = static_cast<const unsigned char*>(data);
+			for (size_t i = 0; i < size; ++i)
+				hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+
+		template <typename T>
+		void add_value(const T& value) {
+			add(&value, sizeof(T));
+		}
+
+		uint64_t value() const { return hash; }
+
+	private:
+		uint64_t hash = 1469598103934665603ull;
+	};
+
+	// Hash of a file's content, e.g. the material configuration that goes into the cache key
+	inline uint64_t hash_file(const std::string& path) {
+		bsp_cache_hasher hasher;
+		mapped_file file(path);
+		if (file.is_open())
+			hasher.add(file.data(), file.size());
+		return hasher.value();
+	}
+
+	class bsp_cache_writer {
+	public:
+		template <typename T>
+		void section(const bsp_cache_section_id id, const T* data, const size_t count) {
+			// Sections start 8 byte aligned, so the mapped arrays can be read in place
+			body.resize((body.size() + 7) & ~size_t(7));
+			sections[id] = bsp_cache_section{ sizeof(bsp_cache_header) + body.size(), count };
+			const size_t offset = body.size();
+			body.resize(offset + count * sizeof(T));
+			if (count)
+				std::memcpy(body.data() + offset, data, count * sizeof(T));
+		}
+
+		template <typename T>
+		void section(const bsp_cache_section_id id, const std::vector<T>& data) {
+			section(id, data.data(), data.size());
+		}
+
+		/*!
+			Write to a temporary file next to path first and replace path with it in one step, so a crash or a concurrent
+			writer never leaves a truncated or mixed cache behind; readers see the old or the new file
+		*/
+		bool write(const std::string& path, const uint64_t content_hash, const int32_t tree_height) const {
+			bsp_cache_header header;
+			std::memset(&header, 0, sizeof(header));
+			std::memcpy(header.magic, BSP_CACHE_MAGIC, sizeof(header.magic));
+			header.version = BSP_CACHE_VERSION;
+			header.byte_order = BSP_CACHE_BYTE_ORDER;
+			header.content_hash = content_hash;
+			header.tree_height = tree_height;
+			header.section_count = BSP_CACHE_SECTION_COUNT;
+			std::memcpy(header.sections, sections, sizeof(sections));
+
+			// Unique per process and per call, concurrent writers never share a temporary file
+			static std::atomic<uint32_t> write_count{ 0 };
+#ifdef _WIN32
+			const long process_id = (long)_getpid();
+#else
+			const long process_id = (long)getpid();
+#endif
+			const std::string temporary = path + ".tmp." + std::to_string(process_id) + "." + std::to_string(write_count++);
+			std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+			if (!out)
+				return false;
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(reinterpret_cast<const char*>(body.data()), (std::streamsize)body.size());
+			// close() flushes, a failure there is a failed write as well
+			out.close();
+			if (!out) {
+				std::remove(temporary.c_str());
+				return false;
+			}
+#ifdef _WIN32
+			const bool replaced = MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+			// rename replaces an existing path atomically on POSIX
+			const bool replaced = std::rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+			if (!replaced)
+				std::remove(temporary.c_str());
+			return replaced;
+		}
+
+	private:
+		bsp_cache_section sections[BSP_CACHE_SECTION_COUNT] = {};
+		std::vector<unsigned char> body;
+	};
+
+	class bsp_cache_reader {
+	public:
+		/*!
+			Map the cache file and check magic, version, byte order, content hash and section bounds
+
+			/return false if the cache is missing, stale or damaged; the room has to be built then
+		*/
+		bool open(const std::string& path, const uint64_t expected_hash) {
+			if (!file.open(path) || file.size() < sizeof(bsp_cache_header))
+				return false;
+			std::memcpy(&header, file.data(), sizeof(header));
+			if (std::memcmp(header.magic, BSP_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != BSP_CACHE_VERSION
+				|| header.byte_order != BSP_CACHE_BYTE_ORDER || header.section_count != BSP_CACHE_SECTION_COUNT || header.content_hash != expected_hash)
+				return false;
+			for (auto& i : header.sections) {
+				if (i.offset % 8 != 0 || i.offset > file.size() || i.count > (file.size() - i.offset))
+					return false;
+			}
+			return true;
+		}
+
+		// Typed view of a section, nullptr if it is too small for count elements of T
+		template <typename T>
+		const T* section(const bsp_cache_section_id id, size_t& count) const {
+			const bsp_cache_section& s = header.sections[id];
+			count = (size_t)s.count;
+			if (s.count > (file.size() - s.offset) / sizeof(T))
+				return nullptr;
+			return reinterpret_cast<const T*>(file.data() + s.offset);
+		}
+
+		int32_t tree_height() const { return header.tree_height; }
+
+	private:
+		mapped_file file;
+		bsp_cache_header header;
+	};
+}
@@ -0,0 +1,600 @@
+/*
+* Cells of the flattened BSP tree and a potentially visible set (PVS) between them. Every leaf node and
+* every missing child of an interior node is a convex region of space, a cell with a dense ID
+* (assign_bsp_cells); locate_bsp_cell walks a point down the tree to its cell.
+* Cells touch through portals: the parts of the splitting planes not covered by the walls lying in them.
+* bsp_pvs_builder cuts each splitting plane (clipped to the region of its node) into the pieces bordering
+* the cells on both sides, keeps the overlaps no single node wall covers, and floods from every cell
+* through sequences of portals. A sequence is followed only while a straight line can pass through all
+* of its portals, tested conservatively by clipping each portal to the separating planes between the
+* first and the current portal. Everything is built in double precision at build time and may allocate;
+* the result is one bit row per cell, read by room_model::cells_potentially_visible. The builder reads the query
+* geometry of either precision, see basic_bsp_query_geometry.
+*/
+
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "flat_bsp.h"
+#include "wall_bitset.h"
+
+namespace rts {
+
+	/*!
+		Give every cell of the tree a dense ID: node_cells[2 * i] is the cell of leaf i or of the missing front child of
+		interior node i, node_cells[2 * i + 1] the cell of its missing back child, BSP_NULL_INDEX where there is none.
+		IDs follow the pre-order of the nodes, front before back, so they only depend on the tree.
+
+		/return number of cells
+	*/
+	inline uint32_t assign_bsp_cells(const std::vector<FlatBSPNode>& nodes, std::vector<uint32_t>& node_cells) {
+		node_cells.assign(2 * nodes.size(), BSP_NULL_INDEX);
+		uint32_t count = 0;
+		for (size_t i = 0; i < nodes.size(); ++i) {
+			if (nodes[i].leaf_node) {
+				node_cells[2 * i] = count++;
+				continue;
+			}
+			if (nodes[i].front == BSP_NULL_INDEX)
+				node_cells[2 * i] = count++;
+			if (nodes[i].back == BSP_NULL_INDEX)
+				node_cells[2 * i + 1] = count++;
+		}
+		return count;
+	}
+
+	// Cell containing point, points on a splitting plane count as in front of it like in the traversal; BSP_NULL_INDEX for an empty tree
+	template <typename Scalar>
+	inline uint32_t locate_bsp_cell(const FlatBSPNode* nodes, const size_t node_count, const Scalar* node_planes, const uint32_t* node_cells, const bsp_scalar_arg<Scalar> x, const bsp_scalar_arg<Scalar> y, const bsp_scalar_arg<Scalar> z) {
+		if (!node_count)
+			return BSP_NULL_INDEX;
+		uint32_t node = 0;
+		while (true) {
+			const FlatBSPNode& current = nodes[node];
+			if (current.leaf_node)
+				return node_cells[2 * (size_t)node];
+			const bool front = plane_distance(&node_planes[4 * (size_t)node], x, y, z) >= Scalar(0);
+			const uint32_t child = front ? current.front : current.back;
+			if (child == BSP_NULL_INDEX)
+				return node_cells[2 * (size_t)node + (front ? 0 : 1)];
+			node = child;
+		}
+	}
+
+	namespace pvs_detail {
+		using point = std::array<double, 3>;
+		using polygon = std::vector<point>;
+
+		// Distances below this count as on a plane, polygons with a smaller area as empty
+		constexpr double PLANE_EPSILON = 1e-5;
+		constexpr double AREA_EPSILON = 1e-8;
+
+		struct plane {
+			double n[3];
+			double d;
+
+			double distance(const point& p) const { return n[0] * p[0] + n[1] * p[1] + n[2] * p[2] + d; }
+			plane flipped() const { return plane{ { -n[0], -n[1], -n[2] }, -d }; }
+		};
+
+		inline point cross(const point& a, const point& b) {
+			return point{ a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+		}
+
+		inline point sub(const point& a, const point& b) {
+			return point{ a[0] - b[0], a[1] - b[1], a[2] - b[2] };
+		}
+
+		inline double length(const point& a) {
+			return std::sqrt(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+		}
+
+		inline double area(const polygon& p) {
+			point sum{ 0.0, 0.0, 0.0 };
+			for (size_t i = 1; i + 1 < p.size(); ++i) {
+				const point c = cross(sub(p[i], p[0]), sub(p[i + 1], p[0]));
+				for (int k = 0; k < 3; ++k)
+					sum[k] += c[k];
+			}
+			return 0.5 * length(sum);
+		}
+
+		inline bool is_empty(const polygon& p) {
+			return p.size() < 3 || area(p) < AREA_EPSILON;
+		}
+
+		// Keep the part of in on the front side of p (Sutherland-Hodgman), result in out
+		inline void clip(const polygon& in, const plane& p, polygon& out) {
+			out.clear();
+			for (size_t i = 0; i < in.size(); ++i) {
+				const point& a = in[i];
+				const point& b = in[(i + 1) % in.size()];
+				const double da = p.distance(a), db = p.distance(b);
+				if (da >= -PLANE_EPSILON)
+					out.push_back(a);
+				if ((da > PLANE_EPSILON && db < -PLANE_EPSILON) || (da < -PLANE_EPSILON && db > PLANE_EPSILON)) {
+					const double t = da / (da - db);
+					out.push_back(point{ a[0] + t * (b[0] - a[0]), a[1] + t * (b[1] - a[1]), a[2] + t * (b[2] - a[2]) });
+				}
+			}
+		}
+
+		// Same, in place; false once nothing is left
+		inline bool clip_in_place(polygon& p, const plane& by, polygon& scratch) {
+			clip(p, by, scratch);
+			p.swap(scratch);
+			return !is_empty(p);
+		}
+
+		// The part of plane p inside the box [low, high]
+		inline polygon plane_in_box(const plane& p, const point& low, const point& high) {
+			const point center{ 0.5 * (low[0] + high[0]), 0.5 * (low[1] + high[1]), 0.5 * (low[2] + high[2]) };
+			const double size = length(sub(high, low)) + 1.0;
+			const double offset = p.distance(center);
+			const point origin{ center[0] - offset * p.n[0], center[1] - offset * p.n[1], center[2] - offset * p.n[2] };
+			// Two axes spanning the plane
+			const point normal{ p.n[0], p.n[1], p.n[2] };
+			const point helper = std::fabs(normal[0]) < 0.6 ? point{ 1.0, 0.0, 0.0 } : point{ 0.0, 1.0, 0.0 };
+			point u = cross(normal, helper);
+			const double u_length = length(u);
+			for (auto& k : u)
+				k /= u_length;
+			const point v = cross(normal, u);
+			polygon result, scratch;
+			for (int corner = 0; corner < 4; ++corner) {
+				const double a = (corner == 0 || corner == 3) ? -size : size;
+				const double b = corner < 2 ? -size : size;
+				result.push_back(point{ origin[0] + a * u[0] + b * v[0], origin[1] + a * u[1] + b * v[1], origin[2] + a * u[2] + b * v[2] });
+			}
+			for (int k = 0; k < 3; ++k) {
+				plane above{ { 0.0, 0.0, 0.0 }, -low[k] }, below{ { 0.0, 0.0, 0.0 }, high[k] };
+				above.n[k] = 1.0;
+				below.n[k] = -1.0;
+				if (!clip_in_place(result, above, scratch) || !clip_in_place(result, below, scratch))
+					return polygon();
+			}
+			return result;
+		}
+
+		/*!
+			Clip target to the lines passing through both source and pass: for every plane through an edge of one and a
+			vertex of the other that has source on one side and pass on the other, only the side of pass can be reached
+
+			/return false if nothing of target is left
+		*/
+		inline bool clip_to_separators(const polygon& source, const polygon& pass, polygon& target, polygon& scratch) {
+			for (int flip = 0; flip < 2; ++flip) {
+				const polygon& edges = flip ? source : pass;
+				const polygon& vertices = flip ? pass : source;
+				for (size_t i = 0; i < edges.size(); ++i) {
+					const point& e0 = edges[i];
+					const point& e1 = edges[(i + 1) % edges.size()];
+					for (auto& v : vertices) {
+						point n = cross(sub(e1, e0), sub(v, e0));
+						const double n_length = length(n);
+						if (n_length < PLANE_EPSILON)
+							continue;
+						plane separator{ { n[0] / n_length, n[1] / n_length, n[2] / n_length }, 0.0 };
+						separator.d = -(separator.n[0] * v[0] + separator.n[1] * v[1] + separator.n[2] * v[2]);
+						// Source strictly on one side
+						int source_side = 0;
+						for (auto& k : source) {
+							const double distance = separator.distance(k);
+							source_side |= distance > PLANE_EPSILON ? 1 : distance < -PLANE_EPSILON ? 2 : 0;
+						}
+						if (source_side != 1 && source_side != 2)
+							continue;
+						// Pass on the other side or in the plane
+						bool separates = true;
+						for (auto& k : pass) {
+							const double distance = separator.distance(k);
+							if ((source_side == 1 && distance > PLANE_EPSILON) || (source_side == 2 && distance < -PLANE_EPSILON))
+								separates = false;
+						}
+						if (!separates)
+							continue;
+						if (!clip_in_place(target, source_side == 1 ? separator.flipped() : separator, scratch))
+							return false;
+					}
+				}
+			}
+			return true;
+		}
+	}
+
+	// Opening between two cells in the plane of an interior node, its plane faces the front cell
+	struct bsp_portal {
+		uint32_t front_cell;
+		uint32_t back_cell;
+		pvs_detail::plane plane;
+		pvs_detail::polygon polygon;
+	};
+
+	template <typename Scalar>
+	class basic_bsp_pvs_builder {
+	public:
+		/*!
+			/param tree_nodes, tree_wall_indices
+			The flattened tree, flat_bsp_nodes and flat_bsp_wall_indices
+			/param wall_geometry
+			Wall planes and corners by dense wall index, the room is bounded by the box around all corners
+			/param cell_of_node, cells
+			From assign_bsp_cells
+		*/
+		basic_bsp_pvs_builder(const std::vector<FlatBSPNode>& tree_nodes, const std::vector<uint32_t>& tree_wall_indices, const basic_bsp_query_geometry<Scalar>& wall_geometry, const std::vector<uint32_t>& cell_of_node, const uint32_t cells)
+			: nodes(tree_nodes), node_wall_indices(tree_wall_indices), geometry(wall_geometry), node_cells(cell_of_node), cell_count(cells) {
+			low = pvs_detail::point{ 0.0, 0.0, 0.0 };
+			high = pvs_detail::point{ 0.0, 0.0, 0.0 };
+			for (uint32_t i = 0; i < geometry.corner_count(); ++i) {
+				const pvs_detail::point c = corner(i);
+				for (int k = 0; k < 3; ++k) {
+					low[k] = i ? std::min(low[k], c[k]) : c[k];
+					high[k] = i ? std::max(high[k], c[k]) : c[k];
+				}
+			}
+			// Leave room around the walls, so the cells outside the room have portals too
+			const double margin = 0.1 * pvs_detail::length(pvs_detail::sub(high, low)) + 1.0;
+			for (int k = 0; k < 3; ++k) {
+				low[k] -= margin;
+				high[k] += margin;
+			}
+		}
+
+		// Portals between the cells, each one bordering exactly one cell on either side
+		void build_portals() {
+			portals.clear();
+			std::vector<std::pair<pvs_detail::plane, bool>> region;
+			if (!nodes.empty())
+				build_portals(0, region);
+			cell_portal_offsets.assign(cell_count + 1, 0);
+			for (auto& i : portals) {
+				cell_portal_offsets[i.front_cell + 1]++;
+				cell_portal_offsets[i.back_cell + 1]++;
+			}
+			for (uint32_t i = 0; i < cell_count; ++i)
+				cell_portal_offsets[i + 1] += cell_portal_offsets[i];
+			cell_portals.assign(cell_portal_offsets.back(), 0);
+			std::vector<uint32_t> next(cell_portal_offsets.begin(), cell_portal_offsets.end() - 1);
+			for (uint32_t i = 0; i < portals.size(); ++i) {
+				cell_portals[next[portals[i].front_cell]++] = i;
+				cell_portals[next[portals[i].back_cell]++] = i;
+			}
+		}
+
+		/*!
+			PVS of every cell as bit rows of (cell_count + 63) / 64 words, call build_portals() first. The relation is made
+			symmetric and every cell sees itself. Takes cell_count^2 / 8 bytes, e.g. about 300 MB for 50k cells.
+
+			/param step_budget
+			Portals entered per source cell before the flood from it falls back to plain portal connectivity, which bounds
+			the exponential worst case of the portal sequence search
+			/param exhausted
+			Output, number of source cells that hit the budget
+		*/
+		std::vector<uint64_t> compute_pvs(const size_t step_budget, size_t& exhausted) {
+			const size_t row_words = ((size_t)cell_count + 63) / 64;
+			std::vector<uint64_t> pvs(row_words * cell_count, 0);
+			on_path.assign(cell_count, 0);
+			exhausted = 0;
+			std::vector<uint64_t> reachable(row_words);
+			for (uint32_t cell = 0; cell < cell_count; ++cell) {
+				uint64_t* row = &pvs[row_words * cell];
+				// Once every cell connected to this one is marked there is nothing left to find
+				std::fill(reachable.begin(), reachable.end(), 0);
+				connect(cell, reachable.data());
+				size_t reachable_count = 0;
+				for (auto i : reachable)
+					reachable_count += detail::bit_count(i);
+				flood_state state{ row, 1, reachable_count, 0, step_budget, false };
+				row[cell / 64] |= uint64_t(1) << (cell % 64);
+				on_path[cell] = 1;
+				flood(cell, state);
+				on_path[cell] = 0;
+				if (state.exhausted) {
+					exhausted++;
+					connect(cell, row);
+				}
+			}
+			for (uint32_t a = 0; a < cell_count; ++a)
+				for (uint32_t b = a + 1; b < cell_count; ++b) {
+					const bool visible = ((pvs[row_words * a + b / 64] >> (b % 64)) & 1) || ((pvs[row_words * b + a / 64] >> (a % 64)) & 1);
+					if (visible) {
+						pvs[row_words * a + b / 64] |= uint64_t(1) << (b % 64);
+						pvs[row_words * b + a / 64] |= uint64_t(1) << (a % 64);
+					}
+				}
+			return pvs;
+		}
+
+		/*!
+			Cells bordering the front side of a wall of node: the wall pushed into the subtree on its front side
+
+			/param wall
+			Dense wall index, one of the walls of node
+		*/
+		std::vector<uint32_t> wall_front_cells(const uint32_t node, const uint32_t wall) const {
+			pvs_detail::polygon polygon;
+			for (uint32_t k = geometry.corner_offsets[wall]; k < geometry.corner_offsets[wall + 1]; ++k)
+				polygon.push_back(corner(k));
+			std::vector<std::pair<uint32_t, pvs_detail::polygon>> pieces;
+			if (nodes[node].leaf_node)
+				pieces.emplace_back(node_cells[2 * (size_t)node], polygon);
+			else {
+				// Walls of the opposite orientation share the node, their front is the back of the splitting plane
+				const Scalar* node_plane = &geometry.node_planes[4 * (size_t)node];
+				const bool same_facing = node_plane[0] * geometry.normal_x[wall] + node_plane[1] * geometry.normal_y[wall] + node_plane[2] * geometry.normal_z[wall] >= Scalar(0);
+				push_child(node, same_facing ? 0 : 1, polygon, pieces);
+			}
+			std::vector<uint32_t> result;
+			for (auto& i : pieces)
+				result.push_back(i.first);
+			std::sort(result.begin(), result.end());
+			result.erase(std::unique(result.begin(), result.end()), result.end());
+			return result;
+		}
+
+		const std::vector<bsp_portal>& portal_list() const { return portals; }
+
+	private:
+		using piece_list = std::vector<std::pair<uint32_t, pvs_detail::polygon>>;
+
+		struct flood_state {
+			uint64_t* row;
+			size_t marked;
+			size_t reachable;
+			size_t steps;
+			size_t budget;
+			bool exhausted;
+		};
+
+		// A cell on the portal sequence of flood: the portal it was entered through (clipped, plane facing away from the
+		// start cell) and the next of its portals to enter
+		struct flood_frame {
+			uint32_t cell;
+			uint32_t next_portal;
+			int depth;
+			pvs_detail::polygon pass;
+			pvs_detail::plane pass_plane;
+		};
+
+		pvs_detail::plane node_plane(const uint32_t node) const {
+			const Scalar* p = &geometry.node_planes[4 * (size_t)node];
+			return pvs_detail::plane{ { (double)p[0], (double)p[1], (double)p[2] }, (double)p[3] };
+		}
+
+		pvs_detail::point corner(const uint32_t k) const {
+			return pvs_detail::point{ (double)geometry.corner_x[k], (double)geometry.corner_y[k], (double)geometry.corner_z[k] };
+		}
+
+		bool has_plane(const uint32_t node) const {
+			const Scalar* p = &geometry.node_planes[4 * (size_t)node];
+			return p[0] != Scalar(0) || p[1] != Scalar(0) || p[2] != Scalar(0);
+		}
+
+		// Split polygon along the tree below side (0 front, 1 back) of node, collecting the pieces reaching a cell
+		void push_child(const uint32_t node, const int side, const pvs_detail::polygon& polygon, piece_list& out) const {
+			const uint32_t child = side ? nodes[node].back : nodes[node].front;
+			if (child == BSP_NULL_INDEX)
+				out.emplace_back(node_cells[2 * (size_t)node + side], polygon);
+			else
+				push_node(child, polygon, out);
+		}
+
+		void push_node(const uint32_t node, const pvs_detail::polygon& polygon, piece_list& out) const {
+			if (nodes[node].leaf_node) {
+				out.emplace_back(node_cells[2 * (size_t)node], polygon);
+				return;
+			}
+			if (!has_plane(node)) {
+				push_child(node, 0, polygon, out);
+				return;
+			}
+			const pvs_detail::plane p = node_plane(node);
+			pvs_detail::polygon front, back;
+			pvs_detail::clip(polygon, p, front);
+			pvs_detail::clip(polygon, p.flipped(), back);
+			const bool front_empty = pvs_detail::is_empty(front), back_empty = pvs_detail::is_empty(back);
+			// A polygon in the plane itself only happens within the plane map tolerance, it borders the front side
+			if (front_empty && back_empty)
+				push_child(node, 0, polygon, out);
+			if (!front_empty)
+				push_child(node, 0, front, out);
+			if (!back_empty)
+				push_child(node, 1, back, out);
+		}
+
+		// True if one wall of node covers all of polygon
+		bool covered_by_node_wall(const uint32_t node, const pvs_detail::polygon& polygon) const {
+			const FlatBSPNode& current = nodes[node];
+			for (uint32_t w = 0; w < current.wall_count; ++w) {
+				const uint32_t wall = node_wall_indices[current.wall_offset + w];
+				const pvs_detail::point normal{ (double)geometry.normal_x[wall], (double)geometry.normal_y[wall], (double)geometry.normal_z[wall] };
+				const uint32_t first = geometry.corner_offsets[wall], last = geometry.corner_offsets[wall + 1];
+				if (last - first < 3)
+					continue;
+				bool inside = true;
+				for (auto& p : polygon) {
+					// Same side of every edge as the interior, like segment_wall_hit, with the distance to the edge line
+					bool positive = false, negative = false;
+					for (uint32_t k = first; k < last && inside; ++k) {
+						const pvs_detail::point c0 = corner(k);
+						const pvs_detail::point edge = pvs_detail::sub(corner(k + 1 < last ? k + 1 : first), c0);
+						const pvs_detail::point to_point = pvs_detail::sub(p, c0);
+						const pvs_detail::point c = pvs_detail::cross(edge, to_point);
+						const double edge_length = pvs_detail::length(edge);
+						if (edge_length < pvs_detail::PLANE_EPSILON)
+							continue;
+						const double side = (normal[0] * c[0] + normal[1] * c[1] + normal[2] * c[2]) / edge_length;
+						positive |= side > 1e-4;
+						negative |= side < -1e-4;
+						inside = !(positive && negative);
+					}
+					if (!inside)
+						break;
+				}
+				if (inside)
+					return true;
+			}
+			return false;
+		}
+
+		/*!
+			Portals in the plane of node, then recurse; region holds the half-spaces of the ancestors (plane, keep front)
+		*/
+		void build_portals(const uint32_t node, std::vector<std::pair<pvs_detail::plane, bool>>& region) {
+			const FlatBSPNode& current = nodes[node];
+			if (current.leaf_node || !has_plane(node)) {
+				if (!current.leaf_node && current.front != BSP_NULL_INDEX)
+					build_portals(current.front, region);
+				return;
+			}
+			const pvs_detail::plane p = node_plane(node);
+			pvs_detail::polygon polygon = pvs_detail::plane_in_box(p, low, high), scratch;
+			bool empty = polygon.empty();
+			for (auto& i : region) {
+				if (empty)
+					break;
+				empty = !pvs_detail::clip_in_place(polygon, i.second ? i.first : i.first.flipped(), scratch);
+			}
+			if (!empty) {
+				piece_list front_pieces, back_pieces;
+				push_child(node, 0, polygon, front_pieces);
+				push_child(node, 1, polygon, back_pieces);
+				for (auto& f : front_pieces) {
+					for (auto& b : back_pieces) {
+						// Overlap of two convex polygons in the same plane: clip one by the edge planes of the other
+						pvs_detail::polygon overlap = f.second;
+						bool overlap_empty = false;
+						const pvs_detail::point normal{ p.n[0], p.n[1], p.n[2] };
+						pvs_detail::point center{ 0.0, 0.0, 0.0 };
+						for (auto& k : b.second)
+							for (int c = 0; c < 3; ++c)
+								center[c] += k[c] / (double)b.second.size();
+						for (size_t k = 0; k < b.second.size() && !overlap_empty; ++k) {
+							const pvs_detail::point& e0 = b.second[k];
+							const pvs_detail::point& e1 = b.second[(k + 1) % b.second.size()];
+							pvs_detail::point n = pvs_detail::cross(normal, pvs_detail::sub(e1, e0));
+							const double n_length = pvs_detail::length(n);
+							if (n_length < pvs_detail::PLANE_EPSILON)
+								continue;
+							pvs_detail::plane edge{ { n[0] / n_length, n[1] / n_length, n[2] / n_length }, 0.0 };
+							edge.d = -(edge.n[0] * e0[0] + edge.n[1] * e0[1] + edge.n[2] * e0[2]);
+							if (edge.distance(center) < 0.0)
+								edge = edge.flipped();
+							overlap_empty = !pvs_detail::clip_in_place(overlap, edge, scratch);
+						}
+						if (overlap_empty || f.first == b.first || covered_by_node_wall(node, overlap))
+							continue;
+						portals.push_back(bsp_portal{ f.first, b.first, p, std::move(overlap) });
+					}
+				}
+			}
+			if (current.front != BSP_NULL_INDEX) {
+				region.emplace_back(p, true);
+				build_portals(current.front, region);
+				region.pop_back();
+			}
+			if (current.back != BSP_NULL_INDEX) {
+				region.emplace_back(p, false);
+				build_portals(current.back, region);
+				region.pop_back();
+			}
+		}
+
+		/*!
+			Depth-first search over the portal sequences from start, stops early once every cell connected to it is marked.
+			Iterative with an explicit stack of flood_frame, sequences can be as long as the step budget. source is the first
+			portal of the current sequence, pass the last one of each frame; depth 0 is the start cell itself
+		*/
+		void flood(const uint32_t start, flood_state& state) {
+			pvs_detail::polygon source, target, scratch;
+			pvs_detail::plane source_plane;
+			frames.clear();
+			frames.push_back(flood_frame{ start, cell_portal_offsets[start], 0, pvs_detail::polygon(), pvs_detail::plane() });
+			while (!frames.empty() && !state.exhausted && state.marked != state.reachable) {
+				flood_frame& frame = frames.back();
+				if (frame.next_portal == cell_portal_offsets[frame.cell + 1]) {
+					if (frame.depth > 0)
+						on_path[frame.cell] = 0;
+					frames.pop_back();
+					continue;
+				}
+				const bsp_portal& portal = portals[cell_portals[frame.next_portal++]];
+				const bool leaving_to_front = portal.back_cell == frame.cell;
+				const uint32_t next = leaving_to_front ? portal.front_cell : portal.back_cell;
+				if (on_path[next])
+					continue;
+				if (++state.steps > state.budget) {
+					state.exhausted = true;
+					break;
+				}
+				const pvs_detail::plane portal_plane = leaving_to_front ? portal.plane : portal.plane.flipped();
+				target = portal.polygon;
+				const int depth = frame.depth;
+				if (depth > 0) {
+					// Lines from the source have to cross the source and the pass portal before they reach this one
+					if (!pvs_detail::clip_in_place(target, source_plane, scratch) || !pvs_detail::clip_in_place(target, frame.pass_plane, scratch))
+						continue;
+					if (depth > 1 && !pvs_detail::clip_to_separators(source, frame.pass, target, scratch))
+						continue;
+				}
+				else {
+					source = target;
+					source_plane = portal_plane;
+				}
+				if (!((state.row[next / 64] >> (next % 64)) & 1)) {
+					state.row[next / 64] |= uint64_t(1) << (next % 64);
+					state.marked++;
+				}
+				on_path[next] = 1;
+				frames.push_back(flood_frame{ next, cell_portal_offsets[next], depth + 1, target, portal_plane });
+			}
+			// Left early: the cells still on the stack are no longer on the path
+			for (auto& i : frames)
+				if (i.depth > 0)
+					on_path[i.cell] = 0;
+			frames.clear();
+		}
+
+		// Fallback: everything reachable through portals at all
+		void connect(const uint32_t cell, uint64_t* row) const {
+			std::vector<uint32_t> open{ cell };
+			row[cell / 64] |= uint64_t(1) << (cell % 64);
+			while (!open.empty()) {
+				const uint32_t current = open.back();
+				open.pop_back();
+				for (uint32_t k = cell_portal_offsets[current]; k < cell_portal_offsets[current + 1]; ++k) {
+					const bsp_portal& portal = portals[cell_portals[k]];
+					const uint32_t next = portal.front_cell == current ? portal.back_cell : portal.front_cell;
+					if (!((row[next / 64] >> (next % 64)) & 1)) {
+						row[next / 64] |= uint64_t(1) << (next % 64);
+						open.push_back(next);
+					}
+				}
+			}
+		}
+
+		const std::vector<FlatBSPNode>& nodes;
+		const std::vector<uint32_t>& node_wall_indices;
+		const basic_bsp_query_geometry<Scalar>& geometry;
+		const std::vector<uint32_t>& node_cells;
+		const uint32_t cell_count;
+		pvs_detail::point low, high;
+
+		std::vector<bsp_portal> portals;
+		// Portals of cell c: [cell_portal_offsets[c], cell_portal_offsets[c + 1]) of cell_portals
+		std::vector<uint32_t> cell_portal_offsets;
+		std::vector<uint32_t> cell_portals;
+		std::vector<uint8_t> on_path;
+		// Stack of flood, kept between the source cells
+		std::vector<flood_frame> frames;
+	};
+
+	using bsp_pvs_builder = basic_bsp_pvs_builder<float>;
+}
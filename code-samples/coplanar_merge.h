@@ -0,0 +1,322 @@
+/*
+* Pre-pass of the BSP build for tessellated meshes: adjacent coplanar walls with the same material are
+* merged into larger convex polygons, so a flat wall split into dozens of triangles becomes one splitter
+* candidate and one image-source plane again. Walls are grouped by plane (quantised like the plane-polygon
+* map) and material; within a group two polygons are merged across an edge they share (same corners in
+* opposite order) as long as the union stays convex. Merging is greedy and repeats until no pair is left.
+*/
+
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <armadillo>
+
+#include "wall.h"
+
+namespace rts {
+
+	namespace merge_detail {
+		using point = std::array<float, 3>;
+		using polygon = std::vector<point>;
+
+		// Relative tolerance of the convexity and collinearity tests
+		constexpr double TURN_EPSILON = 1e-6;
+
+		template <typename T, typename = void>
+		struct is_equality_comparable : std::false_type {};
+
+		template <typename T>
+		struct is_equality_comparable<T, std::void_t<decltype(std::declval<const T&>() == std::declval<const T&>())>> : std::true_type {};
+
+		// Default material comparison of merge_coplanar_walls, the material type has to provide operator==
+		struct material_equal {
+			template <typename T>
+			bool operator()(const T& a, const T& b) const {
+				static_assert(is_equality_comparable<T>::value, "merge_coplanar_walls needs operator== on the wall material or an explicit comparator");
+				return a == b;
+			}
+		};
+
+		struct edge_key {
+			point a, b;
+			bool operator==(const edge_key& other) const { return a == other.a && b == other.b; }
+		};
+
+		struct edge_key_hash {
+			size_t operator()(const edge_key& key) const {
+				uint64_t h = 1469598103934665603ull;
+				for (auto& p : { key.a, key.b })
+					for (auto i : p) {
+						uint32_t bits;
+						std::memcpy(&bits, &i, sizeof(bits));
+						h = (h ^ bits) * 1099511628211ull;
+					}
+				return (size_t)h;
+			}
+		};
+
+		struct plane_key {
+			int64_t k[4];
+			bool operator==(const plane_key& other) const { return std::equal(k, k + 4, other.k); }
+		};
+
+		struct plane_key_hash {
+			size_t operator()(const plane_key& key) const {
+				uint64_t h = 1469598103934665603ull;
+				for (auto i : key.k)
+					h = (h ^ (uint64_t)i) * 1099511628211ull;
+				return (size_t)h;
+			}
+		};
+
+		inline std::array<double, 3> turn(const point& a, const point& b, const point& c) {
+			const double ux = (double)b[0] - a[0], uy = (double)b[1] - a[1], uz = (double)b[2] - a[2];
+			const double vx = (double)c[0] - b[0], vy = (double)c[1] - b[1], vz = (double)c[2] - b[2];
+			return { uy * vz - uz * vy, uz * vx - ux * vz, ux * vy - uy * vx };
+		}
+
+		inline double length(const std::array<double, 3>& v) {
+			return std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+		}
+
+		// Newell normal, not normalised
+		inline std::array<double, 3> newell_normal(const polygon& p) {
+			std::array<double, 3> n{ 0.0, 0.0, 0.0 };
+			for (size_t i = 0; i < p.size(); ++i) {
+				const point& a = p[i];
+				const point& b = p[(i + 1) % p.size()];
+				n[0] += ((double)a[1] - b[1]) * ((double)a[2] + b[2]);
+				n[1] += ((double)a[2] - b[2]) * ((double)a[0] + b[0]);
+				n[2] += ((double)a[0] - b[0]) * ((double)a[1] + b[1]);
+			}
+			return n;
+		}
+
+		// Signed turn at every corner relative to the polygon normal, scaled to the edge lengths
+		inline double relative_turn(const polygon& p, const size_t i, const std::array<double, 3>& unit_normal) {
+			const point& a = p[(i + p.size() - 1) % p.size()];
+			const point& b = p[i];
+			const point& c = p[(i + 1) % p.size()];
+			const std::array<double, 3> t = turn(a, b, c);
+			const double ab = std::sqrt(((double)b[0] - a[0]) * ((double)b[0] - a[0]) + ((double)b[1] - a[1]) * ((double)b[1] - a[1]) + ((double)b[2] - a[2]) * ((double)b[2] - a[2]));
+			const double bc = std::sqrt(((double)c[0] - b[0]) * ((double)c[0] - b[0]) + ((double)c[1] - b[1]) * ((double)c[1] - b[1]) + ((double)c[2] - b[2]) * ((double)c[2] - b[2]));
+			if (ab == 0.0 || bc == 0.0)
+				return 0.0;
+			return (t[0] * unit_normal[0] + t[1] * unit_normal[1] + t[2] * unit_normal[2]) / (ab * bc);
+		}
+
+		// Convex and without repeated corners
+		inline bool is_convex(const polygon& p) {
+			const std::array<double, 3> n = newell_normal(p);
+			const double n_length = length(n);
+			if (n_length == 0.0)
+				return false;
+			const std::array<double, 3> unit{ n[0] / n_length, n[1] / n_length, n[2] / n_length };
+			for (size_t i = 0; i < p.size(); ++i) {
+				if (relative_turn(p, i, unit) < -TURN_EPSILON)
+					return false;
+				for (size_t j = i + 1; j < p.size(); ++j)
+					if (p[i] == p[j])
+						return false;
+			}
+			return true;
+		}
+
+		// a and b joined along the edge a[i] -> a[i + 1], which b has as b[j + 1] -> b[j]
+		inline polygon join(const polygon& a, const size_t i, const polygon& b, const size_t j) {
+			polygon result;
+			result.reserve(a.size() + b.size() - 2);
+			for (size_t k = 0; k < a.size(); ++k)
+				result.push_back(a[(i + 1 + k) % a.size()]);
+			for (size_t k = 2; k < b.size(); ++k)
+				result.push_back(b[(j + k) % b.size()]);
+			return result;
+		}
+
+		// Drop corners on a straight edge, left over from the merges
+		inline void remove_collinear(polygon& p) {
+			const std::array<double, 3> n = newell_normal(p);
+			const double n_length = length(n);
+			if (n_length == 0.0)
+				return;
+			const std::array<double, 3> unit{ n[0] / n_length, n[1] / n_length, n[2] / n_length };
+			for (size_t i = 0; i < p.size() && p.size() > 3;) {
+				if (std::abs(relative_turn(p, i, unit)) <= TURN_EPSILON)
+					p.erase(p.begin() + i);
+				else
+					++i;
+			}
+		}
+
+		// Greedy merging of the polygons of one plane and material; merged-away polygons are emptied, owner[p] is the
+		// polygon that p ended up in
+		inline void merge_group(std::vector<polygon>& polygons, std::vector<uint32_t>& owner) {
+			std::unordered_map<edge_key, std::pair<uint32_t, uint32_t>, edge_key_hash> edges;
+			std::vector<uint8_t> touched(polygons.size());
+			owner.resize(polygons.size());
+			for (uint32_t p = 0; p < polygons.size(); ++p)
+				owner[p] = p;
+			bool merged = true;
+			while (merged) {
+				merged = false;
+				edges.clear();
+				for (uint32_t p = 0; p < polygons.size(); ++p)
+					for (uint32_t i = 0; i < polygons[p].size(); ++i)
+						edges[edge_key{ polygons[p][i], polygons[p][(i + 1) % polygons[p].size()] }] = { p, i };
+				// Each polygon takes part in at most one merge per round, the edge map stays valid for the others
+				std::fill(touched.begin(), touched.end(), 0);
+				for (uint32_t p = 0; p < polygons.size(); ++p) {
+					if (touched[p] || polygons[p].empty())
+						continue;
+					for (uint32_t i = 0; i < polygons[p].size(); ++i) {
+						auto other = edges.find(edge_key{ polygons[p][(i + 1) % polygons[p].size()], polygons[p][i] });
+						if (other == edges.end())
+							continue;
+						const uint32_t q = other->second.first;
+						if (q == p || touched[q] || polygons[q].empty())
+							continue;
+						polygon joined = join(polygons[p], i, polygons[q], other->second.second);
+						if (!is_convex(joined))
+							continue;
+						polygons[p] = std::move(joined);
+						polygons[q].clear();
+						owner[q] = p;
+						touched[p] = touched[q] = 1;
+						merged = true;
+						break;
+					}
+				}
+			}
+			for (auto& i : polygons)
+				if (!i.empty())
+					remove_collinear(i);
+			// A polygon merged into p may see p merged on later, follow the chain to the one that is left
+			for (uint32_t p = 0; p < polygons.size(); ++p) {
+				uint32_t o = owner[p];
+				while (owner[o] != o)
+					o = owner[o];
+				owner[p] = o;
+			}
+		}
+	}
+
+	/*!
+		Merge adjacent coplanar walls with the same material into larger convex polygons. A merged polygon keeps ID,
+		material, normal and distance of the first wall merged into it, so it still refers to that input wall; the
+		other walls merged into it are left out. Disabled walls are passed through unchanged.
+
+		/param epsilon
+		Tolerance on the normal components and d for two walls to count as coplanar, like BSPBuildOptions::plane_map_epsilon
+		/param merged_into
+		Optional output, for every input wall the index of the input wall whose merged polygon (and ID) it became part
+		of, itself if it was not merged into another one
+		/param same_material
+		Whether two wall materials are equal, only walls with equal materials are merged
+	*/
+	template <typename MaterialEqual = merge_detail::material_equal>
+	std::vector<rts::wall> merge_coplanar_walls(const std::vector<rts::wall>& walls, const double epsilon, std::vector<uint32_t>* merged_into = nullptr, const MaterialEqual& same_material = MaterialEqual()) {
+		using merge_detail::plane_key;
+		// Groups of walls in one plane with one material, found through their quantised planes like the plane-polygon map
+		std::vector<std::vector<uint32_t>> groups;
+		std::unordered_map<plane_key, std::vector<uint32_t>, merge_detail::plane_key_hash> buckets;
+		const double step = epsilon > 0.0 ? epsilon : 1e-9;
+		auto key_of = [step](const rts::wall& w) {
+			const double values[4] = { (double)w.n.at(0), (double)w.n.at(1), (double)w.n.at(2), (double)w.d };
+			plane_key key;
+			for (int k = 0; k < 4; ++k)
+				key.k[k] = (int64_t)std::floor(values[k] / step);
+			return key;
+		};
+		auto coplanar = [epsilon](const rts::wall& a, const rts::wall& b) {
+			for (int k = 0; k < 3; ++k)
+				if (std::abs((double)a.n.at(k) - (double)b.n.at(k)) > epsilon)
+					return false;
+			return std::abs((double)a.d - (double)b.d) <= epsilon;
+		};
+		std::vector<uint32_t> group_of(walls.size(), 0xFFFFFFFFu);
+		for (uint32_t w = 0; w < walls.size(); ++w) {
+			if (!walls[w].enabled)
+				continue;
+			const plane_key key = key_of(walls[w]);
+			uint32_t match = 0xFFFFFFFFu;
+			for (int dx = -1; dx <= 1; ++dx)
+				for (int dy = -1; dy <= 1; ++dy)
+					for (int dz = -1; dz <= 1; ++dz)
+						for (int dd = -1; dd <= 1; ++dd) {
+							auto bucket = buckets.find(plane_key{ { key.k[0] + dx, key.k[1] + dy, key.k[2] + dz, key.k[3] + dd } });
+							if (bucket == buckets.end())
+								continue;
+							for (auto g : bucket->second) {
+								const rts::wall& first = walls[groups[g][0]];
+								if (g < match && coplanar(first, walls[w]) && same_material(first.material, walls[w].material))
+									match = g;
+							}
+						}
+			if (match == 0xFFFFFFFFu) {
+				match = (uint32_t)groups.size();
+				groups.emplace_back();
+				buckets[key].push_back(match);
+			}
+			groups[match].push_back(w);
+			group_of[w] = match;
+		}
+
+		// Merged polygon of every wall, empty if it was merged into another one
+		std::vector<merge_detail::polygon> merged(walls.size());
+		std::vector<merge_detail::polygon> polygons;
+		std::vector<uint32_t> owner;
+		if (merged_into) {
+			merged_into->resize(walls.size());
+			for (uint32_t w = 0; w < walls.size(); ++w)
+				(*merged_into)[w] = w;
+		}
+		for (auto& group : groups) {
+			polygons.clear();
+			for (auto w : group) {
+				merge_detail::polygon p;
+				for (auto& c : walls[w].corners)
+					p.push_back(merge_detail::point{ c[0], c[1], c[2] });
+				polygons.push_back(std::move(p));
+			}
+			if (group.size() > 1)
+				merge_detail::merge_group(polygons, owner);
+			for (size_t k = 0; k < group.size(); ++k)
+				merged[group[k]] = std::move(polygons[k]);
+			if (merged_into && group.size() > 1)
+				for (size_t k = 0; k < group.size(); ++k)
+					(*merged_into)[group[k]] = group[owner[k]];
+		}
+
+		std::vector<rts::wall> result;
+		for (uint32_t w = 0; w < walls.size(); ++w) {
+			if (group_of[w] == 0xFFFFFFFFu) {
+				result.push_back(walls[w]);
+				continue;
+			}
+			if (merged[w].empty())
+				continue;
+			// Unchanged polygons are copied as they are
+			if (merged[w].size() == walls[w].corners.size() && groups[group_of[w]].size() == 1) {
+				result.push_back(walls[w]);
+				continue;
+			}
+			std::vector<arma::fvec3> corners;
+			for (auto& c : merged[w])
+				corners.push_back(arma::fvec3{ c[0], c[1], c[2] });
+			rts::wall merged_wall{ walls[w].id, corners, walls[w].material, true, true };
+			// Same plane as the input wall, like the fragments of the BSP build
+			merged_wall.n = walls[w].n;
+			merged_wall.double_n = walls[w].double_n;
+			merged_wall.d = walls[w].d;
+			result.push_back(std::move(merged_wall));
+		}
+		return result;
+	}
+}
@@ -0,0 +1,347 @@
+/*
+* Flattened BSP tree and the visibility kernels working on it. The room model keeps its tree as one
+* contiguous node array with 32-bit child indices and wall ranges into a shared index array; the wall
+* planes and corners the kernels need are packed next to it (bsp_query_geometry) as cache line aligned
+* structure of arrays (x[], y[], z[]), so a query touches a few flat arrays instead of chasing rts::wall
+* pointers and Armadillo objects.
+* trace_packet finds the first blocking wall for a packet of up to BSP_PACKET_SIZE segments at once:
+* all lanes descend the tree together with a per-packet active mask, each lane clipped to its own
+* parametric interval, so nodes are fetched once per packet instead of once per segment. The traversal
+* is iterative on a caller-owned stack (bsp_traversal_stack) sized from the tree height, so it does not
+* allocate and can run on the audio thread.
+* Geometry, packets and kernels are templated on the scalar type of the query coordinates: float for the
+* real-time builds, double for offline renders; the unprefixed names are the float versions.
+*/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace rts {
+
+	// Marks a missing child of a FlatBSPNode and a missing result of the visibility kernels
+	constexpr uint32_t BSP_NULL_INDEX = 0xFFFFFFFFu;
+
+	// Node of the flattened BSP tree: children are indices into room_model::flat_bsp_nodes, the node walls are the
+	// range [wall_offset, wall_offset + wall_count) of room_model::flat_bsp_wall_indices
+	struct FlatBSPNode {
+		uint32_t front = BSP_NULL_INDEX;
+		uint32_t back = BSP_NULL_INDEX;
+		uint32_t wall_offset = 0;
+		uint32_t wall_count = 0;
+		bool leaf_node = false;
+	};
+
+	// Alignment of the structure of arrays in bsp_query_geometry: one cache line, enough for any vector load
+	constexpr size_t BSP_SOA_ALIGNMENT = 64;
+
+	// Allocator for BSP_SOA_ALIGNMENT aligned arrays
+	template <typename T>
+	struct aligned_allocator {
+		using value_type = T;
+
+		aligned_allocator() = default;
+		template <typename U>
+		aligned_allocator(const aligned_allocator<U>&) {}
+
+		T* allocate(const size_t n) {
+			return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(BSP_SOA_ALIGNMENT)));
+		}
+
+		void deallocate(T* p, size_t) {
+			::operator delete(p, std::align_val_t(BSP_SOA_ALIGNMENT));
+		}
+
+		template <typename U>
+		bool operator==(const aligned_allocator<U>&) const { return true; }
+		template <typename U>
+		bool operator!=(const aligned_allocator<U>&) const { return false; }
+	};
+
+	template <typename T>
+	using aligned_vector = std::vector<T, aligned_allocator<T>>;
+
+	// Geometry of the flattened tree for the visibility kernels, walls indexed by their dense index (pwalls_BSP)
+	template <typename Scalar>
+	struct basic_bsp_query_geometry {
+		static_assert(std::is_floating_point<Scalar>::value, "query geometry needs a floating point scalar");
+
+		// Splitting plane of each node (the plane of its walls), a, b, c, d with side of p = a*p.x + b*p.y + c*p.z + d,
+		// the same convention the tree was built with; zero for leaves. Interleaved, the traversal reads one node at a time
+		std::vector<Scalar> node_planes;
+		// Plane of each wall as structure of arrays: side of p = normal_x[i] * p.x + normal_y[i] * p.y + normal_z[i] * p.z + plane_d[i]
+		aligned_vector<Scalar> normal_x, normal_y, normal_z, plane_d;
+		// Corners of wall i are [corner_offsets[i], corner_offsets[i + 1]) of corner_x, corner_y and corner_z
+		std::vector<uint32_t> corner_offsets;
+		aligned_vector<Scalar> corner_x, corner_y, corner_z;
+
+		size_t wall_count() const { return plane_d.size(); }
+		size_t corner_count() const { return corner_x.size(); }
+
+		Scalar wall_distance(const uint32_t wall, const Scalar x, const Scalar y, const Scalar z) const {
+			return normal_x[wall] * x + normal_y[wall] * y + normal_z[wall] * z + plane_d[wall];
+		}
+
+		// Append the next wall, its corners follow with add_corner
+		void add_wall(const Scalar nx, const Scalar ny, const Scalar nz, const Scalar d) {
+			if (corner_offsets.empty())
+				corner_offsets.push_back(0);
+			normal_x.push_back(nx);
+			normal_y.push_back(ny);
+			normal_z.push_back(nz);
+			plane_d.push_back(d);
+			corner_offsets.push_back((uint32_t)corner_x.size());
+		}
+
+		void add_corner(const Scalar x, const Scalar y, const Scalar z) {
+			corner_x.push_back(x);
+			corner_y.push_back(y);
+			corner_z.push_back(z);
+			corner_offsets.back()++;
+		}
+
+		void reserve(const size_t walls, const size_t corners) {
+			for (auto i : { &normal_x, &normal_y, &normal_z, &plane_d })
+				i->reserve(walls);
+			corner_offsets.reserve(walls + 1);
+			for (auto i : { &corner_x, &corner_y, &corner_z })
+				i->reserve(corners);
+		}
+
+		void clear() {
+			node_planes.clear();
+			for (auto i : { &normal_x, &normal_y, &normal_z, &plane_d, &corner_x, &corner_y, &corner_z })
+				i->clear();
+			corner_offsets.clear();
+		}
+	};
+
+	using bsp_query_geometry = basic_bsp_query_geometry<float>;
+
+	// Everything a traversal reads, owned by the room model
+	template <typename Scalar>
+	struct basic_bsp_query_view {
+		const FlatBSPNode* nodes;
+		const uint32_t* node_wall_indices;
+		const basic_bsp_query_geometry<Scalar>* geometry;
+		// Runtime enabled mask, one bit per dense wall index; atomic words, walls may be toggled during a traversal
+		const std::atomic<uint64_t>* enabled_mask;
+	};
+
+	using bsp_query_view = basic_bsp_query_view<float>;
+
+	constexpr size_t BSP_PACKET_SIZE = 8;
+	// Distances below this count as on a plane; hits closer than this (in t) to a segment end are ignored, so
+	// segments ending on a wall, e.g. at a reflection point, are not blocked by it
+	constexpr float BSP_QUERY_EPSILON = 1e-4f;
+
+	// Segments of one packet as structure of arrays, plus the closest hit found so far per lane
+	template <typename Scalar>
+	struct basic_bsp_packet {
+		Scalar start[3][BSP_PACKET_SIZE];
+		Scalar end[3][BSP_PACKET_SIZE];
+		Scalar best_t[BSP_PACKET_SIZE];
+		uint32_t best_wall[BSP_PACKET_SIZE];
+	};
+
+	using bsp_packet = basic_bsp_packet<float>;
+
+	// The scalar type of a kernel is taken from its geometry only, point coordinates are converted to it
+	template <typename T>
+	using bsp_scalar_arg = typename std::common_type<T>::type;
+
+	template <typename Scalar>
+	inline Scalar plane_distance(const Scalar* plane, const bsp_scalar_arg<Scalar> x, const bsp_scalar_arg<Scalar> y, const bsp_scalar_arg<Scalar> z) {
+		return plane[0] * x + plane[1] * y + plane[2] * z + plane[3];
+	}
+
+	/*!
+		Parameter t in (0, 1) at which the segment start -> end passes through the wall, or 1 if it does not
+	*/
+	template <typename Scalar>
+	inline Scalar segment_wall_hit(const basic_bsp_query_geometry<Scalar>& g, const uint32_t wall, const bsp_scalar_arg<Scalar> sx, const bsp_scalar_arg<Scalar> sy, const bsp_scalar_arg<Scalar> sz,
+		const bsp_scalar_arg<Scalar> ex, const bsp_scalar_arg<Scalar> ey, const bsp_scalar_arg<Scalar> ez) {
+		const Scalar epsilon = BSP_QUERY_EPSILON;
+		const Scalar ds = g.wall_distance(wall, sx, sy, sz);
+		const Scalar de = g.wall_distance(wall, ex, ey, ez);
+		// Both ends on the same side or touching the plane: no proper crossing
+		if ((ds > -epsilon && de > -epsilon) || (ds < epsilon && de < epsilon))
+			return Scalar(1);
+		const Scalar t = ds / (ds - de);
+		if (t <= epsilon || t >= Scalar(1) - epsilon)
+			return Scalar(1);
+		const Scalar x = sx + t * (ex - sx), y = sy + t * (ey - sy), z = sz + t * (ez - sz);
+		// Inside a convex polygon the point is on the same side of every edge, independent of the winding
+		bool positive = false, negative = false;
+		const Scalar nx = g.normal_x[wall], ny = g.normal_y[wall], nz = g.normal_z[wall];
+		const Scalar* cx = g.corner_x.data();
+		const Scalar* cy = g.corner_y.data();
+		const Scalar* cz = g.corner_z.data();
+		const uint32_t first = g.corner_offsets[wall], last = g.corner_offsets[wall + 1];
+		for (uint32_t k = first; k < last; ++k) {
+			const uint32_t next = k + 1 < last ? k + 1 : first;
+			const Scalar ux = cx[next] - cx[k], uy = cy[next] - cy[k], uz = cz[next] - cz[k];
+			const Scalar wx = x - cx[k], wy = y - cy[k], wz = z - cz[k];
+			const Scalar side = nx * (uy * wz - uz * wy) + ny * (uz * wx - ux * wz) + nz * (ux * wy - uy * wx);
+			positive |= side > Scalar(1e-6);
+			negative |= side < -Scalar(1e-6);
+			if (positive && negative)
+				return Scalar(1);
+		}
+		return t;
+	}
+
+	// Test the enabled walls of a node against the lanes in mask, keeping the closest hit per lane
+	template <typename Scalar>
+	inline void test_node_walls(const basic_bsp_query_view<Scalar>& view, const FlatBSPNode& node, const uint32_t mask, basic_bsp_packet<Scalar>& packet) {
+		for (uint32_t k = 0; k < node.wall_count; ++k) {
+			const uint32_t wall = view.node_wall_indices[node.wall_offset + k];
+			if (!((view.enabled_mask[wall / 64].load(std::memory_order_relaxed) >> (wall % 64)) & 1))
+				continue;
+			for (uint32_t lane = 0; lane < BSP_PACKET_SIZE; ++lane) {
+				if (!(mask & (1u << lane)))
+					continue;
+				const Scalar t = segment_wall_hit(*view.geometry, wall, packet.start[0][lane], packet.start[1][lane], packet.start[2][lane], packet.end[0][lane], packet.end[1][lane], packet.end[2][lane]);
+				if (t < packet.best_t[lane]) {
+					packet.best_t[lane] = t;
+					packet.best_wall[lane] = wall;
+				}
+			}
+		}
+	}
+
+	// Pending subtree of a packet traversal: lanes in mask, lane i restricted to [t0[i], t1[i]] of its segment
+	template <typename Scalar>
+	struct basic_bsp_packet_frame {
+		uint32_t node;
+		uint32_t mask;
+		Scalar t0[BSP_PACKET_SIZE];
+		Scalar t1[BSP_PACKET_SIZE];
+	};
+
+	/*!
+		Explicit stack for trace_packet. The traversal keeps at most one pending sibling per level, so tree height + 1
+		frames always suffice; reserve once outside the real-time thread, traversals then never allocate.
+	*/
+	template <typename Scalar>
+	class basic_bsp_traversal_stack {
+	public:
+		void reserve(const int tree_height) {
+			const size_t needed = (size_t)std::max(tree_height, 0) + 1;
+			if (frames.size() < needed)
+				frames.resize(needed);
+		}
+
+		size_t capacity() const { return frames.size(); }
+		basic_bsp_packet_frame<Scalar>* data() { return frames.data(); }
+
+	private:
+		std::vector<basic_bsp_packet_frame<Scalar>> frames;
+	};
+
+	using bsp_traversal_stack = basic_bsp_traversal_stack<float>;
+
+	/*!
+		Find the closest enabled wall for the lanes in mask, starting at root with the whole segments.
+		Leaves test all their walls; interior nodes only test their (coplanar) walls for lanes crossing the splitting plane.
+		Returns false, with the results of the packet incomplete, if stack is too small for the tree.
+
+		/param stack
+		Reserved for the height of the tree, see bsp_traversal_stack
+	*/
+	template <typename Scalar>
+	inline bool trace_packet(const basic_bsp_query_view<Scalar>& view, const uint32_t root, const uint32_t mask, basic_bsp_packet<Scalar>& packet, basic_bsp_traversal_stack<Scalar>& stack) {
+		const Scalar epsilon = BSP_QUERY_EPSILON;
+		basic_bsp_packet_frame<Scalar>* frames = stack.data();
+		const size_t capacity = stack.capacity();
+		size_t top = 0;
+		if (root == BSP_NULL_INDEX || !mask)
+			return true;
+		if (capacity == 0)
+			return false;
+		frames[top].node = root;
+		frames[top].mask = mask;
+		for (uint32_t lane = 0; lane < BSP_PACKET_SIZE; ++lane) {
+			frames[top].t0[lane] = Scalar(0);
+			frames[top].t1[lane] = Scalar(1);
+		}
+		++top;
+
+		while (top) {
+			const basic_bsp_packet_frame<Scalar>& frame = frames[--top];
+			uint32_t active = frame.mask;
+			// Lanes that already hit something before their interval starts cannot find a closer wall in this subtree
+			for (uint32_t lane = 0; lane < BSP_PACKET_SIZE; ++lane)
+				if ((active & (1u << lane)) && packet.best_t[lane] <= frame.t0[lane])
+					active &= ~(1u << lane);
+			if (!active)
+				continue;
+			const FlatBSPNode& node = view.nodes[frame.node];
+			if (node.leaf_node) {
+				test_node_walls(view, node, active, packet);
+				continue;
+			}
+
+			const Scalar* plane = &view.geometry->node_planes[4 * (size_t)frame.node];
+			basic_bsp_packet_frame<Scalar> front, back;
+			front.node = node.front;
+			back.node = node.back;
+			uint32_t front_mask = 0, back_mask = 0, cross_mask = 0;
+			int front_first = 0;
+			for (uint32_t lane = 0; lane < BSP_PACKET_SIZE; ++lane) {
+				front.t0[lane] = back.t0[lane] = frame.t0[lane];
+				front.t1[lane] = back.t1[lane] = frame.t1[lane];
+				if (!(active & (1u << lane)))
+					continue;
+				const uint32_t bit = 1u << lane;
+				const Scalar ds = plane_distance(plane, packet.start[0][lane], packet.start[1][lane], packet.start[2][lane]);
+				const Scalar de = plane_distance(plane, packet.end[0][lane], packet.end[1][lane], packet.end[2][lane]);
+				const Scalar a = ds + frame.t0[lane] * (de - ds), b = ds + frame.t1[lane] * (de - ds);
+				if (a >= -epsilon && b >= -epsilon) {
+					front_mask |= bit;
+					// Lying in the plane: both sides can hold walls touching the segment
+					if (a <= epsilon && b <= epsilon)
+						back_mask |= bit;
+				}
+				else if (a <= epsilon && b <= epsilon)
+					back_mask |= bit;
+				else {
+					const Scalar ts = frame.t0[lane] + (frame.t1[lane] - frame.t0[lane]) * (a / (a - b));
+					cross_mask |= bit;
+					front_mask |= bit;
+					back_mask |= bit;
+					if (a > Scalar(0)) {
+						front.t1[lane] = ts;
+						back.t0[lane] = ts;
+					}
+					else {
+						back.t1[lane] = ts;
+						front.t0[lane] = ts;
+					}
+				}
+				front_first += a >= Scalar(0) ? 1 : -1;
+			}
+			front.mask = node.front != BSP_NULL_INDEX ? front_mask : 0;
+			back.mask = node.back != BSP_NULL_INDEX ? back_mask : 0;
+			if (cross_mask)
+				test_node_walls(view, node, cross_mask, packet);
+			// frame is overwritten from here on. The side most lanes start in is pushed last, so it is visited first and
+			// its hits let the other side skip lanes early
+			const basic_bsp_packet_frame<Scalar>& near_side = front_first >= 0 ? front : back;
+			const basic_bsp_packet_frame<Scalar>& far_side = front_first >= 0 ? back : front;
+			// Checked in every build: a stack reserved for a shorter tree must not overrun frames on the audio thread
+			if (top + (far_side.mask ? 1 : 0) + (near_side.mask ? 1 : 0) > capacity)
+				return false;
+			if (far_side.mask)
+				frames[top++] = far_side;
+			if (near_side.mask)
+				frames[top++] = near_side;
+		}
+		return true;
+	}
+}
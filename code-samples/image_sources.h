@@ -0,0 +1,404 @@
+/*
+* Image-source tree of a room model: the source is mirrored across the planes of the plane-polygon map,
+* each image again across the planes that can follow its plane (the united direct_reflectables of the
+* map entry), up to a maximum reflection order. The tree is built level by level: all images of order k
+* are expanded before any image of order k + 1, in chunks that run in parallel on the work-stealing
+* pool. Every chunk writes into its own buffer and the buffers are appended in chunk order, so the
+* result does not depend on the number of threads or the scheduling.
+* Everything is written against basic_room_model<Scalar>: images of a double model are mirrored, stored
+* and validated in double (image_source_generator_double, image_source_cache_double).
+* image_source_cache validates the images for a moving listener and reuses the results of the previous
+* frame for paths whose outcome cannot have changed; with a PVS in the room model, legs between cells
+* that cannot see each other are rejected before any segment is traced.
+*/
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <armadillo>
+
+#include "room_model.h"
+#include "task_pool.h"
+
+namespace rts {
+
+	// Parent of the first order images
+	constexpr uint32_t IMAGE_SOURCE_ROOT = 0xFFFFFFFFu;
+
+	// Position type of the images, listener and source of a basic_room_model<Scalar>
+	template <typename Scalar>
+	struct image_source_vector;
+
+	template <>
+	struct image_source_vector<float> {
+		using type = arma::fvec3;
+	};
+
+	template <>
+	struct image_source_vector<double> {
+		using type = arma::vec3;
+	};
+
+	template <typename Scalar>
+	struct basic_image_source {
+		typename image_source_vector<Scalar>::type position;
+		// Plane-polygon map entry this image is mirrored across
+		uint32_t plane_id;
+		// Index of the image it was mirrored from in the previous order, IMAGE_SOURCE_ROOT for order 1
+		uint32_t parent;
+	};
+
+	// orders[k] holds the images of reflection order k + 1
+	template <typename Scalar>
+	struct basic_image_source_tree {
+		std::vector<std::vector<basic_image_source<Scalar>>> orders;
+
+		size_t size() const {
+			size_t count = 0;
+			for (auto& i : orders)
+				count += i.size();
+			return count;
+		}
+	};
+
+	struct image_source_options {
+		unsigned int max_order = 3;
+		// Expand each order on a work-stealing pool
+		bool parallel = false;
+		// Number of worker threads, 0 = hardware concurrency
+		unsigned int thread_count = 0;
+		// Images of the previous order expanded per task
+		size_t grain_size = 256;
+	};
+
+	// a, b, c, d of the plane of every plane-polygon map entry, in the precision of the room's queries
+	template <typename Scalar>
+	void image_source_planes(const basic_room_model<Scalar>& room, std::vector<Scalar>& planes) {
+		planes.resize(4 * room.plane_polygon_map.size());
+		for (size_t p = 0; p < room.plane_polygon_map.size(); ++p) {
+			const rts::wall* representative = room.plane_polygon_map[p][0];
+			for (int k = 0; k < 3; ++k)
+				planes[4 * p + k] = basic_room_model<Scalar>::wall_normal(representative, k);
+			planes[4 * p + 3] = room.wall_plane_offset(representative);
+		}
+	}
+
+	template <typename Scalar>
+	class basic_image_source_generator {
+	public:
+		using room_type = basic_room_model<Scalar>;
+		using vector_type = typename image_source_vector<Scalar>::type;
+		using image_source = basic_image_source<Scalar>;
+		using image_source_tree = basic_image_source_tree<Scalar>;
+
+		explicit basic_image_source_generator(const room_type& model) : room(model) {
+			image_source_planes(room, planes);
+			successor_offsets.assign(1, 0);
+			std::vector<uint32_t> next;
+			for (size_t p = 0; p < room.plane_polygon_map.size(); ++p) {
+				// Successors follow from the whole plane, not from whichever of its walls is enabled right now
+				next.clear();
+				for (auto j : room.plane_reflectables(p))
+					if (j->plane_polygon_map_id >= 0 && (size_t)j->plane_polygon_map_id != p)
+						next.push_back((uint32_t)j->plane_polygon_map_id);
+				std::sort(next.begin(), next.end());
+				next.erase(std::unique(next.begin(), next.end()), next.end());
+				successors.insert(successors.end(), next.begin(), next.end());
+				successor_offsets.push_back((uint32_t)successors.size());
+			}
+		}
+
+		/*!
+			Build the image-source tree of source up to options.max_order, skipping planes without enabled walls
+
+			/param pool
+			Pool to expand the orders on if options.parallel is set; a pool with options.thread_count workers is created if null
+		*/
+		void generate(const vector_type& source, const image_source_options& options, image_source_tree& tree, task_pool* pool = nullptr) const {
+			tree.orders.clear();
+			if (options.max_order == 0)
+				return;
+			std::unique_ptr<task_pool> own_pool;
+			if (options.parallel && !pool) {
+				own_pool.reset(new task_pool(options.thread_count));
+				pool = own_pool.get();
+			}
+			if (!options.parallel)
+				pool = nullptr;
+
+			tree.orders.emplace_back();
+			for (uint32_t p = 0; p < room.plane_polygon_map.size(); ++p)
+				reflect(source, p, IMAGE_SOURCE_ROOT, tree.orders.back());
+
+			std::vector<std::vector<image_source>> chunks;
+			for (unsigned int order = 2; order <= options.max_order && !tree.orders.back().empty(); ++order) {
+				const std::vector<image_source>& parents = tree.orders.back();
+				const size_t grain = std::max<size_t>(options.grain_size, 1);
+				const size_t chunk_count = pool ? (parents.size() + grain - 1) / grain : 1;
+				chunks.resize(chunk_count);
+				auto expand = [this, &parents, &chunks, grain, chunk_count](const size_t chunk) {
+					std::vector<image_source>& out = chunks[chunk];
+					out.clear();
+					const size_t first = chunk_count == 1 ? 0 : chunk * grain;
+					const size_t last = chunk_count == 1 ? parents.size() : std::min(parents.size(), first + grain);
+					for (size_t i = first; i < last; ++i)
+						for (uint32_t k = successor_offsets[parents[i].plane_id]; k < successor_offsets[parents[i].plane_id + 1]; ++k)
+							reflect(parents[i].position, successors[k], (uint32_t)i, out);
+				};
+				if (chunk_count > 1) {
+					task_pool::task_group group;
+					for (size_t c = 0; c < chunk_count; ++c)
+						pool->run(group, [&expand, c]() { expand(c); });
+					pool->wait(group);
+				}
+				else
+					expand(0);
+
+				// Append in chunk order, so the tree is the same for any thread count
+				size_t total = 0;
+				for (size_t c = 0; c < chunk_count; ++c)
+					total += chunks[c].size();
+				std::vector<image_source> level;
+				level.reserve(total);
+				for (size_t c = 0; c < chunk_count; ++c)
+					level.insert(level.end(), chunks[c].begin(), chunks[c].end());
+				tree.orders.push_back(std::move(level));
+			}
+			if (tree.orders.back().empty())
+				tree.orders.pop_back();
+		}
+
+	private:
+		// Mirror position across plane_id if that plane can reflect it, i.e. it is enabled and position lies in front of it
+		void reflect(const vector_type& position, const uint32_t plane_id, const uint32_t parent, std::vector<image_source>& out) const {
+			if (!room.is_plane_enabled(plane_id))
+				return;
+			const Scalar* plane = &planes[4 * (size_t)plane_id];
+			const Scalar distance = plane[0] * position[0] + plane[1] * position[1] + plane[2] * position[2] + plane[3];
+			if (distance <= (Scalar)PLANE_SIDE_EPSILON)
+				return;
+			vector_type image = position;
+			for (int k = 0; k < 3; ++k)
+				image[k] -= Scalar(2) * distance * plane[k];
+			out.push_back(image_source{ image, plane_id, parent });
+		}
+
+		const room_type& room;
+		// a, b, c, d of every plane-polygon map entry
+		std::vector<Scalar> planes;
+		// Planes an image of plane p can be mirrored across next: [successor_offsets[p], successor_offsets[p + 1]) of successors
+		std::vector<uint32_t> successor_offsets;
+		std::vector<uint32_t> successors;
+	};
+
+	/*!
+		Validity of the image sources of one tree for a moving listener, reusing the results of the previous frame. An image
+		source is valid if the listener is in front of its last reflecting plane, the path listener -> reflection points ->
+		source hits an enabled wall on every reflecting plane and no leg is blocked. Most paths fail the first test, which
+		only changes when the listener crosses that plane: such results are kept until the plane changes side. All other
+		results depend on the exact listener position and are revalidated when it moves, so the cached validity always
+		equals a full validation. Everything is revalidated for a new tree and after walls were enabled or disabled
+		(room_model::wall_state_generation). If the room has a PVS, a leg whose end cells are not potentially visible from
+		each other fails without tracing it: the listener cell and the cells in front of the reflecting wall, or of the two
+		walls.
+	*/
+	template <typename Scalar>
+	class basic_image_source_cache {
+	public:
+		using room_type = basic_room_model<Scalar>;
+		using vector_type = typename image_source_vector<Scalar>::type;
+		using image_source = basic_image_source<Scalar>;
+		using image_source_tree = basic_image_source_tree<Scalar>;
+
+		struct statistics {
+			// Updates that validated every path: first one, new tree or changed wall state
+			uint64_t full_validations = 0;
+			// Paths whose previous result was reused / that were validated again
+			uint64_t path_hits = 0;
+			uint64_t path_misses = 0;
+			// Legs rejected by the PVS before tracing them
+			uint64_t pvs_rejections = 0;
+		};
+
+		explicit basic_image_source_cache(const room_type& model) : room(model) {
+			image_source_planes(room, planes);
+			plane_wall_offsets.assign(1, 0);
+			for (auto& i : room.plane_polygon_map) {
+				for (auto j : i)
+					plane_walls.push_back(room.wall_index.at(j));
+				plane_wall_offsets.push_back((uint32_t)plane_walls.size());
+			}
+			room.reserve_traversal_stack(stack);
+		}
+
+		/*!
+			Validity of every image source of tree for listener, one flag per image in order of tree.orders, 1 for valid
+			image sources. The flags belong to the cache and stay valid until the next update() or clear().
+		*/
+		const std::vector<uint8_t>& update(const image_source_tree& tree, const vector_type& source, const vector_type& listener) {
+			size_t path_count = 0;
+			order_offsets.clear();
+			for (auto& i : tree.orders) {
+				order_offsets.push_back(path_count);
+				path_count += i.size();
+			}
+			// Results belong to one tree and one enabled state of the walls; a new source position means a new tree
+			const uint64_t generation = room.wall_state_generation();
+			if (path_count != cached_path_count || !same_position(source, cached_source) || generation != cached_generation) {
+				clear();
+				cached_path_count = path_count;
+				cached_source = source;
+				cached_generation = generation;
+			}
+
+			// Same threshold as the front side test in validate, so a result is kept exactly as long as the test would repeat it
+			sides.resize(room.plane_polygon_map.size());
+			for (size_t p = 0; p < sides.size(); ++p)
+				sides[p] = plane_distance(&planes[4 * p], listener[0], listener[1], listener[2]) > BSP_QUERY_EPSILON;
+
+			if (!primed) {
+				counters.full_validations++;
+				valid.resize(path_count);
+				side_planes.resize(path_count);
+				for (size_t order = 0; order < tree.orders.size(); ++order)
+					for (size_t i = 0; i < tree.orders[order].size(); ++i)
+						revalidate(tree, order, i, source, listener);
+				counters.path_misses += path_count;
+				primed = true;
+			}
+			else if (same_position(listener, cached_listener))
+				counters.path_hits += path_count;
+			else {
+				for (size_t order = 0; order < tree.orders.size(); ++order) {
+					for (size_t i = 0; i < tree.orders[order].size(); ++i) {
+						const uint32_t plane_id = side_planes[order_offsets[order] + i];
+						if (plane_id != BSP_NULL_INDEX && sides[plane_id] == previous_sides[plane_id])
+							counters.path_hits++;
+						else {
+							revalidate(tree, order, i, source, listener);
+							counters.path_misses++;
+						}
+					}
+				}
+			}
+			previous_sides.swap(sides);
+			cached_listener = listener;
+			return valid;
+		}
+
+		void clear() {
+			primed = false;
+			cached_path_count = 0;
+		}
+
+		const statistics& stats() const { return counters; }
+		void reset_stats() { counters = statistics(); }
+
+	private:
+		static bool same_position(const vector_type& a, const vector_type& b) {
+			return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+		}
+
+		void revalidate(const image_source_tree& tree, const size_t order, const size_t index, const vector_type& source, const vector_type& listener) {
+			const size_t path = order_offsets[order] + index;
+			uint32_t plane_id = BSP_NULL_INDEX;
+			valid[path] = validate(tree, order, (uint32_t)index, source, listener, plane_id) ? 1 : 0;
+			side_planes[path] = plane_id;
+		}
+
+		// Trace the path back from the listener; side_plane is set if it fails because the listener is behind the last reflecting plane
+		bool validate(const image_source_tree& tree, size_t order, uint32_t index, const vector_type& source, const vector_type& listener, uint32_t& side_plane) {
+			Scalar point[3] = { listener[0], listener[1], listener[2] };
+			bool first_leg = true;
+			// Cells around the start of the current leg: the listener cell, then the cells in front of the last reflecting wall
+			const uint32_t listener_cell = room.locate(point);
+			const uint32_t* cells_begin = &listener_cell;
+			const uint32_t* cells_end = &listener_cell + 1;
+			while (true) {
+				const image_source& image = tree.orders[order][index];
+				const Scalar* plane = &planes[4 * (size_t)image.plane_id];
+				const Scalar image_position[3] = { image.position[0], image.position[1], image.position[2] };
+				const Scalar ds = plane_distance(plane, point[0], point[1], point[2]);
+				const Scalar de = plane_distance(plane, image_position[0], image_position[1], image_position[2]);
+				// The leg towards the image has to pass through the plane from its front side
+				if (ds <= BSP_QUERY_EPSILON || de >= -BSP_QUERY_EPSILON) {
+					if (first_leg && ds <= BSP_QUERY_EPSILON)
+						side_plane = image.plane_id;
+					return false;
+				}
+				first_leg = false;
+				uint32_t hit_wall = BSP_NULL_INDEX;
+				for (uint32_t k = plane_wall_offsets[image.plane_id]; k < plane_wall_offsets[image.plane_id + 1] && hit_wall == BSP_NULL_INDEX; ++k)
+					if (room.is_wall_enabled(plane_walls[k]) && segment_wall_hit(room.query_geometry, plane_walls[k], point[0], point[1], point[2], image_position[0], image_position[1], image_position[2]) < Scalar(1))
+						hit_wall = plane_walls[k];
+				if (hit_wall == BSP_NULL_INDEX)
+					return false;
+				if (!room.cells_potentially_visible(cells_begin, cells_end, room.wall_cells_begin(hit_wall), room.wall_cells_end(hit_wall))) {
+					counters.pvs_rejections++;
+					return false;
+				}
+				cells_begin = room.wall_cells_begin(hit_wall);
+				cells_end = room.wall_cells_end(hit_wall);
+				const Scalar t = ds / (ds - de);
+				Scalar reflection[3];
+				for (int k = 0; k < 3; ++k)
+					reflection[k] = point[k] + t * (image_position[k] - point[k]);
+				if (blocked(point, reflection))
+					return false;
+				std::copy(reflection, reflection + 3, point);
+				if (order == 0)
+					break;
+				index = image.parent;
+				--order;
+			}
+			const Scalar source_position[3] = { source[0], source[1], source[2] };
+			const uint32_t source_cell = room.locate(source_position);
+			if (!room.cells_potentially_visible(cells_begin, cells_end, &source_cell, &source_cell + 1)) {
+				counters.pvs_rejections++;
+				return false;
+			}
+			return !blocked(point, source_position);
+		}
+
+		// A failed trace (stack too small, cannot happen with the stack reserved in the constructor) counts as blocked
+		bool blocked(const Scalar* start, const Scalar* end) {
+			uint32_t blocker = BSP_NULL_INDEX;
+			if (!room.trace_segments(start, end, 1, stack, [&blocker](const size_t, const uint32_t index) { blocker = index; }))
+				return true;
+			return blocker != BSP_NULL_INDEX;
+		}
+
+		const room_type& room;
+		std::vector<Scalar> planes;
+		// Dense indices of the walls of plane p: [plane_wall_offsets[p], plane_wall_offsets[p + 1]) of plane_walls
+		std::vector<uint32_t> plane_wall_offsets;
+		std::vector<uint32_t> plane_walls;
+		basic_bsp_traversal_stack<Scalar> stack;
+
+		// Results of the last update, valid while primed: validity per path, the plane the listener was behind for paths
+		// failing the front side test (BSP_NULL_INDEX for all other paths), listener and side of every plane
+		std::vector<uint8_t> valid;
+		std::vector<uint32_t> side_planes;
+		vector_type cached_listener{ Scalar(0), Scalar(0), Scalar(0) };
+		std::vector<uint8_t> previous_sides;
+		bool primed = false;
+		size_t cached_path_count = 0;
+		vector_type cached_source{ Scalar(0), Scalar(0), Scalar(0) };
+		uint64_t cached_generation = 0;
+		statistics counters;
+		// Scratch reused across updates
+		std::vector<size_t> order_offsets;
+		std::vector<uint8_t> sides;
+	};
+
+	using image_source = basic_image_source<float>;
+	using image_source_tree = basic_image_source_tree<float>;
+	using image_source_generator = basic_image_source_generator<float>;
+	using image_source_cache = basic_image_source_cache<float>;
+	using image_source_double = basic_image_source<double>;
+	using image_source_tree_double = basic_image_source_tree<double>;
+	using image_source_generator_double = basic_image_source_generator<double>;
+	using image_source_cache_double = basic_image_source_cache<double>;
+}
@@ -0,0 +1,112 @@
+/*
+* Read-only memory mapping of a whole file (POSIX mmap / Win32 MapViewOfFile), used to load the binary
+* BSP cache without copying it through a stream first.
+*/
+
+#pragma once
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rts {
+
+	class mapped_file {
+	public:
+		mapped_file() = default;
+
+		explicit mapped_file(const std::string& path) {
+			open(path);
+		}
+
+		~mapped_file() {
+			close();
+		}
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		// Map path read-only, returns false if the file does not exist, is empty or cannot be mapped
+		bool open(const std::string& path) {
+			close();
+#ifdef _WIN32
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+			LARGE_INTEGER file_size;
+			if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+				close();
+				return false;
+			}
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (!mapping) {
+				close();
+				return false;
+			}
+			memory = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			if (!memory) {
+				close();
+				return false;
+			}
+			length = (size_t)file_size.QuadPart;
+#else
+			const int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				return false;
+			struct stat file_stat;
+			if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+				::close(fd);
+				return false;
+			}
+			void* view = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			// The mapping stays valid after closing the descriptor
+			::close(fd);
+			if (view == MAP_FAILED)
+				return false;
+			memory = static_cast<const unsigned char*>(view);
+			length = (size_t)file_stat.st_size;
+#endif
+			return true;
+		}
+
+		void close() {
+#ifdef _WIN32
+			if (memory)
+				UnmapViewOfFile(memory);
+			if (mapping)
+				CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE)
+				CloseHandle(file);
+			mapping = nullptr;
+			file = INVALID_HANDLE_VALUE;
+#else
+			if (memory)
+				munmap(const_cast<unsigned char*>(memory), length);
+#endif
+			memory = nullptr;
+			length = 0;
+		}
+
+		bool is_open() const { return memory != nullptr; }
+		const unsigned char* data() const { return memory; }
+		size_t size() const { return length; }
+
+	private:
+		const unsigned char* memory = nullptr;
+		size_t length = 0;
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#endif
+	};
+}
@@ -0,0 +1,336 @@
+/*
+* Parallel loader for large text OBJ room geometry (scanned venues of several hundred MB), next to the
+* sequential reader in read_obj.h. The file is memory-mapped (mapped_file) and cut into line-aligned
+* chunks. A first pass counts the vertices, faces and face indices of every chunk; prefix sums over the
+* counts give each chunk its place in the preallocated vertex, index and wall buffers, and a second pass
+* parses every chunk straight into them with std::from_chars. Both passes and the construction of the
+* walls run per chunk on a task_pool; the walls of the chunks are then moved into the output in order.
+* Wall IDs are the face numbers in file order and every face gets the material of the last usemtl before
+* it, including one in an earlier chunk, so the result does not depend on the chunking or thread count.
+*/
+
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <armadillo>
+
+#include "mapped_file.h"
+#include "task_pool.h"
+#include "wall.h"
+
+namespace rts {
+
+	struct obj_load_options {
+		// Parse the chunks on a task pool, with thread_count workers (0 = hardware concurrency) if none is passed in
+		bool parallel = true;
+		unsigned int thread_count = 0;
+		// Bytes per chunk, moved forward to the next line end
+		size_t chunk_size = size_t(4) << 20;
+	};
+
+	struct obj_load_stats {
+		size_t bytes = 0;
+		size_t chunks = 0;
+		size_t vertices = 0;
+		size_t faces = 0;
+		// Distinct usemtl names, each resolved once
+		size_t materials = 0;
+		double seconds = 0.0;
+	};
+
+	namespace obj_detail {
+
+		// Material of the faces before the first usemtl of a chunk: the last one of the chunks before it
+		constexpr uint32_t INHERITED_MATERIAL = 0;
+		// Faces before the first usemtl of the file
+		constexpr uint32_t NO_MATERIAL = 0xFFFFFFFFu;
+
+		struct chunk {
+			const char* begin = nullptr;
+			const char* end = nullptr;
+			// First pass
+			size_t vertex_count = 0;
+			size_t face_count = 0;
+			size_t index_count = 0;
+			// Prefix sums over the chunks before this one
+			size_t first_vertex = 0;
+			size_t first_face = 0;
+			size_t first_index = 0;
+			// usemtl names in order of appearance, local material i + 1 is names[i]; local 0 is INHERITED_MATERIAL
+			std::vector<std::string_view> names;
+			// Global material of each local one, filled between the passes
+			std::vector<uint32_t> materials;
+			// Start of the first malformed line, null if none
+			const char* error_at = nullptr;
+			// Walls of the faces of the chunk, in face order
+			std::vector<rts::wall> walls;
+		};
+
+		inline bool is_blank(const char c) {
+			return c == ' ' || c == '\t' || c == '\r';
+		}
+
+		// Next whitespace separated token of [p, end), advances p past it; empty at the end of the line
+		inline std::string_view next_token(const char*& p, const char* end) {
+			while (p != end && is_blank(*p))
+				++p;
+			const char* first = p;
+			while (p != end && !is_blank(*p))
+				++p;
+			return std::string_view(first, (size_t)(p - first));
+		}
+
+		inline bool parse_float(const std::string_view token, float& value) {
+			const char* first = token.data();
+			const char* last = first + token.size();
+			// from_chars does not accept an explicit plus sign
+			if (first != last && *first == '+')
+				++first;
+			const auto result = std::from_chars(first, last, value);
+			return result.ec == std::errc() && result.ptr == last;
+		}
+
+		// Vertex reference of a face token (v, v/vt, v//vn or v/vt/vn) as 0-based index, negative ones relative to vertex_count
+		inline bool parse_index(const std::string_view token, const size_t vertex_count, size_t& index) {
+			const char* first = token.data();
+			const char* last = first + token.size();
+			int64_t value = 0;
+			const auto result = std::from_chars(first, last, value);
+			if (result.ec != std::errc() || (result.ptr != last && *result.ptr != '/') || value == 0)
+				return false;
+			if (value < 0) {
+				if ((uint64_t)-value > vertex_count)
+					return false;
+				index = vertex_count - (size_t)-value;
+			}
+			else
+				index = (size_t)value - 1;
+			return true;
+		}
+
+		/*!
+			Calls f(keyword, rest, line_end) for every line of [begin, end); rest starts after the keyword and line_end is
+			the start of a trailing # comment if there is one, so both passes see the same tokens
+		*/
+		template <typename F>
+		void for_each_line(const char* begin, const char* end, F f) {
+			for (const char* line = begin; line < end;) {
+				const char* line_end = std::find(line, end, '\n');
+				const char* content_end = std::find(line, line_end, '#');
+				const char* p = line;
+				const std::string_view keyword = next_token(p, content_end);
+				if (!keyword.empty() && !f(keyword, p, content_end))
+					return;
+				line = line_end == end ? end : line_end + 1;
+			}
+		}
+
+		// First pass: counts and usemtl names; a usemtl without a name is malformed
+		inline void count_chunk(chunk& c) {
+			for_each_line(c.begin, c.end, [&c](const std::string_view keyword, const char* p, const char* line_end) {
+				if (keyword == "v")
+					c.vertex_count++;
+				else if (keyword == "f") {
+					c.face_count++;
+					while (!next_token(p, line_end).empty())
+						c.index_count++;
+				}
+				else if (keyword == "usemtl") {
+					const std::string_view name = next_token(p, line_end);
+					if (name.empty()) {
+						c.error_at = keyword.data();
+						return false;
+					}
+					c.names.push_back(name);
+				}
+				return true;
+			});
+		}
+
+		/*!
+			Second pass: vertices into vertices (3 floats each), face index ranges into face_offsets / indices and the local
+			material of every face into face_materials, all at the chunk's offsets
+		*/
+		inline void parse_chunk(chunk& c, const size_t total_vertices, float* vertices, uint32_t* face_offsets, uint32_t* indices, uint32_t* face_materials) {
+			size_t vertex = c.first_vertex, face = c.first_face, index = c.first_index;
+			uint32_t material = INHERITED_MATERIAL;
+			for_each_line(c.begin, c.end, [&](const std::string_view keyword, const char* p, const char* line_end) {
+				bool ok = true;
+				if (keyword == "v") {
+					for (int k = 0; k < 3 && ok; ++k)
+						ok = parse_float(next_token(p, line_end), vertices[3 * vertex + k]);
+					++vertex;
+				}
+				else if (keyword == "f") {
+					const size_t first = index;
+					for (std::string_view token = next_token(p, line_end); !token.empty() && ok; token = next_token(p, line_end)) {
+						size_t value = 0;
+						// Relative references count the vertices defined before this line
+						ok = parse_index(token, vertex, value) && value < total_vertices;
+						indices[index++] = (uint32_t)value;
+					}
+					ok = ok && index - first >= 3;
+					face_offsets[face + 1] = (uint32_t)index;
+					face_materials[face++] = material;
+				}
+				else if (keyword == "usemtl")
+					++material;
+				if (!ok)
+					c.error_at = keyword.data();
+				return ok;
+			});
+		}
+	}
+
+	/*!
+		Load the faces of the OBJ file at path as walls: wall i is face i, its corners the referenced vertices and its
+		material material_of(name) for the last usemtl name before it (a default constructed material before the first).
+		material_of is called once per distinct name, from the calling thread. Returns false (walls untouched) if the
+		file cannot be mapped or holds a malformed vertex, face, vertex reference or a usemtl without a name.
+
+		/param pool
+		Pool to parse on if options.parallel is set; a pool with options.thread_count workers is created if null
+	*/
+	template <typename MaterialLookup>
+	bool load_obj_walls(const std::string& path, MaterialLookup material_of, std::vector<rts::wall>& walls, const obj_load_options& options = obj_load_options(),
+		task_pool* pool = nullptr, obj_load_stats* stats = nullptr) {
+		using wall_material = std::remove_cv_t<decltype(rts::wall::material)>;
+		const auto start = std::chrono::steady_clock::now();
+		mapped_file file;
+		if (!file.open(path)) {
+			BOOST_LOG_TRIVIAL(warning) << "Could not map OBJ file " << path << std::endl;
+			return false;
+		}
+		const char* data = reinterpret_cast<const char*>(file.data());
+		const char* data_end = data + file.size();
+
+		// Line-aligned chunks
+		std::vector<obj_detail::chunk> chunks;
+		const size_t chunk_size = std::max<size_t>(options.chunk_size, 1);
+		for (const char* p = data; p < data_end;) {
+			const char* end = data_end - p > (ptrdiff_t)chunk_size ? std::find(p + chunk_size, data_end, '\n') : data_end;
+			end = end == data_end ? end : end + 1;
+			obj_detail::chunk c;
+			c.begin = p;
+			c.end = end;
+			chunks.push_back(std::move(c));
+			p = end;
+		}
+
+		std::unique_ptr<task_pool> own_pool;
+		if (options.parallel && !pool && chunks.size() > 1) {
+			own_pool.reset(new task_pool(options.thread_count));
+			pool = own_pool.get();
+		}
+		if (!options.parallel)
+			pool = nullptr;
+		auto for_each_chunk = [&chunks, pool](auto f) {
+			if (pool && chunks.size() > 1) {
+				task_pool::task_group group;
+				for (size_t c = 0; c < chunks.size(); ++c)
+					pool->run(group, [&f, c]() { f(c); });
+				pool->wait(group);
+			}
+			else
+				for (size_t c = 0; c < chunks.size(); ++c)
+					f(c);
+		};
+
+		// Reports the first malformed line of the file, chunks are in file order
+		auto malformed = [&]() {
+			for (auto& c : chunks) {
+				if (c.error_at) {
+					BOOST_LOG_TRIVIAL(warning) << "Malformed OBJ line " << std::count(data, c.error_at, '\n') + 1 << " in " << path << std::endl;
+					return true;
+				}
+			}
+			return false;
+		};
+
+		for_each_chunk([&chunks](const size_t c) { obj_detail::count_chunk(chunks[c]); });
+		if (malformed())
+			return false;
+
+		// Offsets of the chunks and the global material of every usemtl, in file order
+		size_t vertex_count = 0, face_count = 0, index_count = 0;
+		std::unordered_map<std::string_view, uint32_t> material_ids;
+		std::vector<wall_material> materials;
+		uint32_t current_material = obj_detail::NO_MATERIAL;
+		for (auto& c : chunks) {
+			c.first_vertex = vertex_count;
+			c.first_face = face_count;
+			c.first_index = index_count;
+			vertex_count += c.vertex_count;
+			face_count += c.face_count;
+			index_count += c.index_count;
+			c.materials.push_back(current_material);
+			for (auto name : c.names) {
+				auto id = material_ids.find(name);
+				if (id == material_ids.end()) {
+					id = material_ids.emplace(name, (uint32_t)materials.size()).first;
+					materials.push_back(material_of(std::string(name)));
+				}
+				c.materials.push_back(id->second);
+				current_material = id->second;
+			}
+		}
+		if (index_count > 0xFFFFFFFFu || vertex_count > 0xFFFFFFFFu) {
+			BOOST_LOG_TRIVIAL(warning) << "OBJ file " << path << " is too large for 32-bit indices" << std::endl;
+			return false;
+		}
+
+		// Preallocated for the whole file, every chunk writes its own range
+		std::vector<float> vertices(3 * vertex_count);
+		std::vector<uint32_t> face_offsets(face_count + 1, 0);
+		std::vector<uint32_t> indices(index_count);
+		std::vector<uint32_t> face_materials(face_count);
+		for_each_chunk([&](const size_t c) {
+			obj_detail::parse_chunk(chunks[c], vertex_count, vertices.data(), face_offsets.data(), indices.data(), face_materials.data());
+		});
+		if (malformed())
+			return false;
+
+		// rts::wall has no default constructor, so every chunk constructs its walls into its own vector
+		for_each_chunk([&](const size_t c) {
+			obj_detail::chunk& chunk = chunks[c];
+			chunk.walls.reserve(chunk.face_count);
+			std::vector<arma::fvec3> corners;
+			for (size_t f = chunk.first_face; f < chunk.first_face + chunk.face_count; ++f) {
+				corners.clear();
+				for (uint32_t k = face_offsets[f]; k < face_offsets[f + 1]; ++k) {
+					const float* v = &vertices[3 * (size_t)indices[k]];
+					corners.push_back(arma::fvec3{ v[0], v[1], v[2] });
+				}
+				const uint32_t material = chunk.materials[face_materials[f]];
+				chunk.walls.emplace_back((unsigned int)f, corners, material == obj_detail::NO_MATERIAL ? wall_material() : materials[material], true, true);
+			}
+		});
+		walls.clear();
+		walls.reserve(face_count);
+		for (auto& c : chunks) {
+			walls.insert(walls.end(), std::make_move_iterator(c.walls.begin()), std::make_move_iterator(c.walls.end()));
+			c.walls = std::vector<rts::wall>();
+		}
+
+		if (stats) {
+			stats->bytes = file.size();
+			stats->chunks = chunks.size();
+			stats->vertices = vertex_count;
+			stats->faces = face_count;
+			stats->materials = materials.size();
+			stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		return true;
+	}
+}
@@ -0,0 +1,219 @@
+/*
+* Vectorised classification of a whole polygon set against one plane, used to score the splitter
+* candidates in build_BSP. The vertices of all polygons are packed once per recursion level into a
+* structure of arrays; classify_polygons then evaluates the signed plane distance of every vertex with
+* AVX2 (4 lanes) or SSE2 (2 lanes), selected at runtime, and ORs the vertex results per polygon.
+* classify_vertices_scalar computes exactly the same codes and is used where no SIMD path is available;
+* room_model::classify_polygons_reference keeps the original whichSide() loop as the reference.
+* classifier_path_mismatches compares the paths with each other, BSPBuildOptions::verify_classifier compares
+* them with the reference during a build.
+*/
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RTS_PLANE_CLASSIFY_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(RTS_PLANE_CLASSIFY_X86) && (defined(__GNUC__) || defined(__clang__))
+#define RTS_TARGET_SSE2 __attribute__((target("sse2")))
+#define RTS_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define RTS_TARGET_SSE2
+#define RTS_TARGET_AVX2
+#endif
+
+namespace rts {
+
+	// Side of a polygon relative to a plane: ON = no vertex off the plane, CROSSING = vertices on both sides
+	enum plane_side : uint8_t {
+		SIDE_ON = 0,
+		SIDE_ABOVE = 1,
+		SIDE_BELOW = 2,
+		SIDE_CROSSING = SIDE_ABOVE | SIDE_BELOW
+	};
+
+	// Tolerance for a vertex to count as on the plane. Has to equal the tolerance Plane::whichSide of the spatial
+	// partitioning code applies to the signed distance (that code is not part of this tree), otherwise splitter scores
+	// differ from the reference. BSPBuildOptions::verify_classifier checks exactly that on every classification of a
+	// build and counts disagreements in BuildStats::classifier_mismatches.
+	constexpr double PLANE_SIDE_EPSILON = 1e-5;
+
+	// Plane a*x + b*y + c*z + d = 0, a point p is above if a*p.x + b*p.y + c*p.z + d > epsilon
+	struct plane_coefficients {
+		double a, b, c, d;
+	};
+
+	// Vertices of a polygon set as structure of arrays, polygon i owns the vertices [offsets[i], offsets[i + 1])
+	struct polygon_vertex_soa {
+		std::vector<double> x, y, z;
+		std::vector<uint32_t> offsets{ 0 };
+
+		size_t polygon_count() const { return offsets.size() - 1; }
+		size_t vertex_count() const { return x.size(); }
+
+		void clear() {
+			x.clear();
+			y.clear();
+			z.clear();
+			offsets.assign(1, 0);
+		}
+
+		void add_vertex(const double px, const double py, const double pz) {
+			x.push_back(px);
+			y.push_back(py);
+			z.push_back(pz);
+		}
+
+		void end_polygon() { offsets.push_back((uint32_t)x.size()); }
+	};
+
+	namespace detail {
+		// Per-vertex codes for vertices [begin, end): bit 0 above, bit 1 below
+		inline void classify_vertices_scalar(const plane_coefficients& p, const polygon_vertex_soa& v, const size_t begin, const size_t end, const double eps, uint8_t* codes) {
+			for (size_t i = begin; i < end; ++i) {
+				const double s = p.a * v.x[i] + p.b * v.y[i] + p.c * v.z[i] + p.d;
+				codes[i] = (uint8_t)((s > eps ? SIDE_ABOVE : 0) | (s < -eps ? SIDE_BELOW : 0));
+			}
+		}
+
+#ifdef RTS_PLANE_CLASSIFY_X86
+		// Spreads the bits of a 4 bit compare mask into the low bit of 4 consecutive bytes
+		constexpr uint32_t mask_to_bytes[16] = {
+			0x00000000, 0x00000001, 0x00000100, 0x00000101, 0x00010000, 0x00010001, 0x00010100, 0x00010101,
+			0x01000000, 0x01000001, 0x01000100, 0x01000101, 0x01010000, 0x01010001, 0x01010100, 0x01010101
+		};
+
+		RTS_TARGET_SSE2 inline void classify_vertices_sse2(const plane_coefficients& p, const polygon_vertex_soa& v, const double eps, uint8_t* codes) {
+			const size_t n = v.vertex_count();
+			const __m128d a = _mm_set1_pd(p.a), b = _mm_set1_pd(p.b), c = _mm_set1_pd(p.c), d = _mm_set1_pd(p.d);
+			const __m128d pos_eps = _mm_set1_pd(eps), neg_eps = _mm_set1_pd(-eps);
+			size_t i = 0;
+			for (; i + 2 <= n; i += 2) {
+				// Same evaluation order as the scalar kernel, so both produce identical codes
+				__m128d s = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(a, _mm_loadu_pd(&v.x[i])), _mm_mul_pd(b, _mm_loadu_pd(&v.y[i]))), _mm_mul_pd(c, _mm_loadu_pd(&v.z[i]))), d);
+				const int above = _mm_movemask_pd(_mm_cmpgt_pd(s, pos_eps));
+				const int below = _mm_movemask_pd(_mm_cmplt_pd(s, neg_eps));
+				const uint32_t bytes = mask_to_bytes[above] | (mask_to_bytes[below] << 1);
+				std::memcpy(codes + i, &bytes, 2);
+			}
+			classify_vertices_scalar(p, v, i, n, eps, codes);
+		}
+
+		RTS_TARGET_AVX2 inline void classify_vertices_avx2(const plane_coefficients& p, const polygon_vertex_soa& v, const double eps, uint8_t* codes) {
+			const size_t n = v.vertex_count();
+			const __m256d a = _mm256_set1_pd(p.a), b = _mm256_set1_pd(p.b), c = _mm256_set1_pd(p.c), d = _mm256_set1_pd(p.d);
+			const __m256d pos_eps = _mm256_set1_pd(eps), neg_eps = _mm256_set1_pd(-eps);
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				// No FMA on purpose: fused rounding would make results differ from the scalar kernel
+				__m256d s = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(a, _mm256_loadu_pd(&v.x[i])), _mm256_mul_pd(b, _mm256_loadu_pd(&v.y[i]))), _mm256_mul_pd(c, _mm256_loadu_pd(&v.z[i]))), d);
+				const int above = _mm256_movemask_pd(_mm256_cmp_pd(s, pos_eps, _CMP_GT_OQ));
+				const int below = _mm256_movemask_pd(_mm256_cmp_pd(s, neg_eps, _CMP_LT_OQ));
+				const uint32_t bytes = mask_to_bytes[above] | (mask_to_bytes[below] << 1);
+				std::memcpy(codes + i, &bytes, 4);
+			}
+			classify_vertices_scalar(p, v, i, n, eps, codes);
+		}
+#endif
+	}
+
+	enum class classifier_isa { scalar, sse2, avx2 };
+
+	// Best instruction set available on this CPU, detected once
+	inline classifier_isa detect_classifier_isa() {
+		static const classifier_isa isa = []() {
+#if defined(RTS_PLANE_CLASSIFY_X86) && defined(_MSC_VER)
+			int info[4];
+			__cpuid(info, 0);
+			if (info[0] >= 7) {
+				__cpuidex(info, 1, 0);
+				const bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+				__cpuidex(info, 7, 0);
+				if (os_saves_ymm && (info[1] & (1 << 5)))
+					return classifier_isa::avx2;
+			}
+			return classifier_isa::sse2;
+#elif defined(RTS_PLANE_CLASSIFY_X86)
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2"))
+				return classifier_isa::avx2;
+			if (__builtin_cpu_supports("sse2"))
+				return classifier_isa::sse2;
+			return classifier_isa::scalar;
+#else
+			return classifier_isa::scalar;
+#endif
+		}();
+		return isa;
+	}
+
+	// Whether classify_polygons can run the isa path on this CPU
+	inline bool classifier_isa_supported(const classifier_isa isa) {
+		const classifier_isa best = detect_classifier_isa();
+		return isa == classifier_isa::scalar || isa == best || (isa == classifier_isa::sse2 && best == classifier_isa::avx2);
+	}
+
+	/*!
+		Classify every polygon of vertices against plane in one call, with the isa path (has to be supported)
+
+		/param flags
+		Output, one plane_side per polygon
+		/param vertex_codes
+		Scratch buffer for the per-vertex results, reused across calls to avoid reallocation
+	*/
+	inline void classify_polygons(const plane_coefficients& plane, const polygon_vertex_soa& vertices, uint8_t* flags, std::vector<uint8_t>& vertex_codes, const double eps, const classifier_isa isa) {
+		vertex_codes.resize(vertices.vertex_count());
+		switch (isa) {
+#ifdef RTS_PLANE_CLASSIFY_X86
+		case classifier_isa::avx2:
+			detail::classify_vertices_avx2(plane, vertices, eps, vertex_codes.data());
+			break;
+		case classifier_isa::sse2:
+			detail::classify_vertices_sse2(plane, vertices, eps, vertex_codes.data());
+			break;
+#endif
+		default:
+			detail::classify_vertices_scalar(plane, vertices, 0, vertices.vertex_count(), eps, vertex_codes.data());
+			break;
+		}
+		const size_t polygon_count = vertices.polygon_count();
+		for (size_t i = 0; i < polygon_count; ++i) {
+			uint8_t side = SIDE_ON;
+			for (uint32_t k = vertices.offsets[i]; k < vertices.offsets[i + 1]; ++k)
+				side |= vertex_codes[k];
+			flags[i] = side;
+		}
+	}
+
+	// Same with the best path of this CPU
+	inline void classify_polygons(const plane_coefficients& plane, const polygon_vertex_soa& vertices, uint8_t* flags, std::vector<uint8_t>& vertex_codes, const double eps = PLANE_SIDE_EPSILON) {
+		classify_polygons(plane, vertices, flags, vertex_codes, eps, detect_classifier_isa());
+	}
+
+	/*!
+		Classify with every path this CPU supports and count the polygons whose side differs from the scalar path;
+		the paths are meant to be bit-identical, so anything but 0 is a bug
+	*/
+	inline size_t classifier_path_mismatches(const plane_coefficients& plane, const polygon_vertex_soa& vertices, const double eps = PLANE_SIDE_EPSILON) {
+		const size_t n = vertices.polygon_count();
+		std::vector<uint8_t> scalar(n), other(n), vertex_codes;
+		classify_polygons(plane, vertices, scalar.data(), vertex_codes, eps, classifier_isa::scalar);
+		size_t mismatches = 0;
+		for (auto isa : { classifier_isa::sse2, classifier_isa::avx2 }) {
+			if (!classifier_isa_supported(isa))
+				continue;
+			classify_polygons(plane, vertices, other.data(), vertex_codes, eps, isa);
+			for (size_t i = 0; i < n; ++i)
+				mismatches += other[i] != scalar[i];
+		}
+		return mismatches;
+	}
+}
@@ -0,0 +1,137 @@
+/*
+* Monotonic arena owning every object created while building the room model (PolygonSpatial, rts::wall,
+* BSPNode). Objects are bump-allocated from large blocks and never freed individually; reset() runs all
+* destructors in reverse creation order and keeps the first block for the next build, so rebuilding a
+* room neither leaks nor fragments the heap. Objects allocated elsewhere with new (e.g. the polygons created
+* by split()) can be handed over with adopt() and are deleted on reset() as well.
+*/
+
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rts {
+
+	class room_arena {
+	public:
+		struct statistics {
+			// Objects created in the arena / taken over with adopt()
+			size_t allocations = 0;
+			size_t adopted = 0;
+			// Allocations that needed a new block from the heap
+			size_t block_allocations = 0;
+			size_t bytes_in_use = 0;
+			size_t peak_bytes = 0;
+			size_t blocks = 0;
+		};
+
+		explicit room_arena(const size_t block_size = 1 << 20) : default_block_size(block_size) {}
+
+		~room_arena() {
+			reset();
+		}
+
+		room_arena(const room_arena&) = delete;
+		room_arena& operator=(const room_arena&) = delete;
+
+		/*!
+			Construct a T in the arena (brace initialisation, so aggregates like BSPNode work as well)
+		*/
+		template <typename T, typename... Args>
+		T* create(Args&&... args) {
+			void* memory;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				memory = allocate(sizeof(T), alignof(T));
+			}
+			T* object = new (memory) T{ std::forward<Args>(args)... };
+			if (!std::is_trivially_destructible<T>::value) {
+				std::lock_guard<std::mutex> lock(mutex);
+				destructors.push_back({ object, [](void* p) { static_cast<T*>(p)->~T(); } });
+			}
+			return object;
+		}
+
+		/*!
+			Take ownership of an object allocated with new, it is deleted on reset()
+		*/
+		template <typename T>
+		T* adopt(T* object) {
+			std::lock_guard<std::mutex> lock(mutex);
+			destructors.push_back({ object, [](void* p) { delete static_cast<T*>(p); } });
+			current.adopted++;
+			return object;
+		}
+
+		/*!
+			Destroy all objects in reverse creation order and release every block except the first one, which is
+			reused by the next build. Resets the statistics as well.
+		*/
+		void reset() {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto i = destructors.rbegin(); i != destructors.rend(); ++i)
+				i->destroy(i->object);
+			destructors.clear();
+			if (blocks.size() > 1)
+				blocks.erase(blocks.begin() + 1, blocks.end());
+			block_used = 0;
+			current = statistics();
+			current.blocks = blocks.size();
+		}
+
+		// Statistics since the last reset()
+		statistics stats() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return current;
+		}
+
+	private:
+		struct block {
+			std::unique_ptr<unsigned char[]> memory;
+			size_t size;
+		};
+
+		struct destructor {
+			void* object;
+			void (*destroy)(void*);
+		};
+
+		void* allocate(const size_t size, const size_t alignment) {
+			current.allocations++;
+			if (!blocks.empty()) {
+				size_t offset = (block_used + alignment - 1) & ~(alignment - 1);
+				if (offset + size <= blocks.back().size) {
+					block_used = offset + size;
+					account(size);
+					return blocks.back().memory.get() + offset;
+				}
+			}
+			// Oversized objects get a block of their own; new[] memory is aligned for any fundamental type
+			const size_t block_size = std::max(default_block_size, size);
+			blocks.push_back(block{ std::unique_ptr<unsigned char[]>(new unsigned char[block_size]), block_size });
+			current.block_allocations++;
+			current.blocks = blocks.size();
+			block_used = size;
+			account(size);
+			return blocks.back().memory.get();
+		}
+
+		void account(const size_t size) {
+			current.bytes_in_use += size;
+			current.peak_bytes = std::max(current.peak_bytes, current.bytes_in_use);
+		}
+
+		const size_t default_block_size;
+		std::vector<block> blocks;
+		size_t block_used = 0;
+		std::vector<destructor> destructors;
+		statistics current;
+		mutable std::mutex mutex;
+	};
+}
@@ -11,8 +11,24 @@
 */
 
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iterator>
 #include <map>
+#include <mutex>
+#include <numeric>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include <armadillo>
@@ -21,9 +37,18 @@
 #include <iostream>
 #endif
 
+#include "bsp_cache.h"
+#include "bsp_pvs.h"
+#include "coplanar_merge.h"
+#include "flat_bsp.h"
 #include "material.h"
+#include "plane_classify.h"
 #include "read_obj.h"
+#include "room_arena.h"
+#include "rt_allocation_check.h"
+#include "task_pool.h"
 #include "wall.h"
+#include "wall_bitset.h"
 
 // space partitioning includes (https://github.com/erich666/GraphicsGems/blob/master/gemsv/ch7-4/)
 #include "spatial-partitioning/polygon.h"
@@ -40,13 +65,182 @@ namespace rts {
 		const bool leaf_node = false;
 	};
 
-	class room_model {
+	// Hierarchical wall ID: index of the input wall (parent) in the high half, fragment number within the parent in the low half
+	using wall_uid = uint64_t;
+
+	inline wall_uid make_wall_uid(const uint32_t parent, const uint32_t fragment) {
+		return (uint64_t(parent) << 32) | fragment;
+	}
+
+	inline uint32_t wall_uid_parent(const wall_uid uid) { return (uint32_t)(uid >> 32); }
+	inline uint32_t wall_uid_fragment(const wall_uid uid) { return (uint32_t)uid; }
+
+	// rts::wall::id of a BSP wall keeps its established meaning, parent_id * WALL_ID_FRAGMENTS + fragment. IDs of parents
+	// split into more fragments run into the next parent's range; wall_uid identifies those walls unambiguously
+	constexpr uint32_t WALL_ID_FRAGMENTS = 1000;
+
+	// How build_BSP picks the splitter candidates it scores when BSPBuildOptions::splitter_candidates is set
+	enum class BSPSplitterSelection {
+		random,
+		largest_area
+	};
+
+	// Default tolerance for two walls to share a plane-polygon map entry, on both the normal components and d
+	constexpr double PLANE_MAP_EPSILON = 1e-5;
+
+	// Options for set_up_room_model. The build mode options do not change the resulting tree, the splitter
+	// sampling options trade tree quality for build time on very large meshes.
+	struct BSPBuildOptions {
+		// Build independent subtrees concurrently on a work-stealing pool
+		bool parallel = false;
+		// Subtrees with fewer polygons than this are built serially by the task that reached them
+		size_t parallel_grain_size = 64;
+		// Worker threads used by the parallel build, 0 = hardware concurrency
+		unsigned int thread_count = 0;
+		// Score splitter candidates with the original whichSide() loop instead of the vectorised classifier
+		bool use_reference_classifier = false;
+		// Additionally classify with the reference and every vectorised path the CPU supports and count the polygons
+		// they disagree on (BuildStats::classifier_mismatches); slow, for validating PLANE_SIDE_EPSILON and the kernels
+		bool verify_classifier = false;
+		// Splitter candidates scored per node, 0 = every polygon (full search)
+		size_t splitter_candidates = 0;
+		BSPSplitterSelection splitter_selection = BSPSplitterSelection::random;
+		// Polygons used to estimate the behind/front/crosses counts of each candidate, 0 = all polygons of the node
+		size_t splitter_sample_size = 0;
+		// Seed of the random choices; they only depend on the seed and the polygons of a node, so the parallel
+		// build still produces the same tree as the serial one
+		uint32_t splitter_seed = 0;
+		// Additionally build the tree with the full search and log both, to see what the sampling costs
+		bool compare_with_full_search = false;
+		// Tolerance for merging walls into one plane-polygon map entry, 0 = exact comparison
+		double plane_map_epsilon = PLANE_MAP_EPSILON;
+		// Compute the blockables of pwalls_BSP and of the walls of every node with a uniform grid over the wall bounding
+		// boxes as broad phase and a per-pair narrow phase (update_blockable_walls_spatial), instead of testing every wall
+		// against every pair
+		bool spatial_blockables = false;
+		// Precompute the potentially visible set between the cells of the tree (bsp_pvs.h)
+		bool compute_pvs = false;
+		// Portals entered per cell by the PVS flood before it falls back to portal connectivity for that cell
+		size_t pvs_step_budget = 1 << 16;
+		// Largest cell count a PVS is built for; it takes cells^2 / 8 bytes (32 MB at the default, about 300 MB at 50k
+		// cells). Above it the PVS is skipped with a warning and the room has none
+		size_t pvs_max_cells = 1 << 14;
+		// Merge adjacent coplanar walls with the same material into larger convex polygons before the build
+		// (coplanar_merge.h). Fragments of a merged polygon have the merged polygon as parent and the input wall it kept
+		// the ID of as parent_id; the input walls of one merged polygon can only be enabled and disabled together
+		bool merge_coplanar = false;
+		// Keep direct_reflectables and blockables of pwalls_BSP also as bitsets over the dense wall indices (wall_bitset.h),
+		// which makes the enabled-wall queries word-wise ANDs. Takes N^2 / 8 bytes per set type for N walls, e.g. about
+		// 312 MB each at 50k walls; without it the queries walk the lists
+		bool wall_bitsets = false;
+
+		bool sampled() const { return splitter_candidates != 0 || splitter_sample_size != 0; }
+	};
+
+	// Wall-clock seconds spent in the phases of the last set_up_room_model call
+	struct BuildPhaseTimings {
+		double polygon_conversion = 0.0;
+		double build_BSP = 0.0;
+		double id_harmonisation = 0.0;
+		double plane_polygon_map = 0.0;
+		double blockables = 0.0;
+		double direct_reflectables = 0.0;
+		// Flattening, wall indices and enabled state
+		double post_passes = 0.0;
+		// Portals and potentially visible set, 0 without BSPBuildOptions::compute_pvs
+		double pvs = 0.0;
+
+		double total() const { return polygon_conversion + build_BSP + id_harmonisation + plane_polygon_map + blockables + direct_reflectables + post_passes + pvs; }
+	};
+
+	// Size, shape and cost of the tree of the last set_up_room_model call, to track tree quality across geometry revisions
+	struct BuildStats {
+		size_t input_polygons = 0;
+		size_t bsp_walls = 0;
+		size_t node_count = 0;
+		size_t leaf_count = 0;
+		int tree_height = 0;
+		// Nodes per depth, the root has depth 0
+		std::vector<size_t> depth_histogram;
+		// Polygons cut in two by a splitting plane, bsp_walls / input_polygons
+		size_t splits = 0;
+		double polygon_growth = 0.0;
+		// Per depth, mean over the interior nodes of min / max of the wall counts of their front and back subtree; 1 = balanced
+		std::vector<double> balance_per_level;
+		// Splitter selections and how many of them found no wall meeting the Ranta-Eskola threshold
+		size_t splitter_selections = 0;
+		size_t ranta_eskola_fallbacks = 0;
+		// Polygon sides where a classify_polygons path disagrees with the whichSide() reference, 0 without
+		// BSPBuildOptions::verify_classifier
+		size_t classifier_mismatches = 0;
+		double ranta_eskola_fallback_rate = 0.0;
+		// (wall, reflectable, blocker) tests of update_blockable_walls_spatial over pwalls_BSP and the node walls, and the
+		// tests the full pass would make (every other wall per wall / reflectable pair); both 0 without spatial_blockables
+		size_t blockable_pair_tests = 0;
+		size_t blockable_pair_tests_exhaustive = 0;
+		// Cells of the tree; portals, mean share of the cells potentially visible from a cell and cells whose flood hit
+		// BSPBuildOptions::pvs_step_budget, all 0 without a PVS
+		size_t cell_count = 0;
+		size_t portal_count = 0;
+		double pvs_mean_visible = 0.0;
+		size_t pvs_budget_exhausted = 0;
+		// Enabled walls before and polygons after the coplanar merge, both 0 without BSPBuildOptions::merge_coplanar
+		size_t merge_input_polygons = 0;
+		size_t merged_polygons = 0;
+		// Loaded from the BSP cache: no build phases, splits and selections
+		bool from_cache = false;
+		BuildPhaseTimings timings;
+
+		void write_json(std::ostream& out) const {
+			out << "{\"input_polygons\": " << input_polygons << ", \"bsp_walls\": " << bsp_walls << ", \"nodes\": " << node_count
+				<< ", \"leaves\": " << leaf_count << ", \"tree_height\": " << tree_height << ", \"depth_histogram\": [";
+			for (size_t i = 0; i < depth_histogram.size(); ++i)
+				out << (i ? ", " : "") << depth_histogram[i];
+			out << "], \"splits\": " << splits << ", \"polygon_growth\": " << polygon_growth << ", \"balance_per_level\": [";
+			for (size_t i = 0; i < balance_per_level.size(); ++i)
+				out << (i ? ", " : "") << balance_per_level[i];
+			out << "], \"splitter_selections\": " << splitter_selections << ", \"ranta_eskola_fallbacks\": " << ranta_eskola_fallbacks
+				<< ", \"ranta_eskola_fallback_rate\": " << ranta_eskola_fallback_rate << ", \"classifier_mismatches\": " << classifier_mismatches << ", \"blockable_pair_tests\": " << blockable_pair_tests
+				<< ", \"blockable_pair_tests_exhaustive\": " << blockable_pair_tests_exhaustive << ", \"cells\": " << cell_count << ", \"portals\": " << portal_count
+				<< ", \"pvs_mean_visible\": " << pvs_mean_visible << ", \"pvs_budget_exhausted\": " << pvs_budget_exhausted << ", \"merge_input_polygons\": " << merge_input_polygons
+				<< ", \"merged_polygons\": " << merged_polygons << ", \"from_cache\": " << (from_cache ? "true" : "false")
+				<< ", \"seconds\": {\"polygon_conversion\": " << timings.polygon_conversion << ", \"build_BSP\": " << timings.build_BSP
+				<< ", \"id_harmonisation\": " << timings.id_harmonisation << ", \"plane_polygon_map\": " << timings.plane_polygon_map
+				<< ", \"blockables\": " << timings.blockables << ", \"direct_reflectables\": " << timings.direct_reflectables
+				<< ", \"post_passes\": " << timings.post_passes << ", \"pvs\": " << timings.pvs << ", \"total\": " << timings.total() << "}}";
+		}
+
+		std::string to_json() const {
+			std::ostringstream out;
+			write_json(out);
+			return out.str();
+		}
+	};
+
+	/*!
+		Room model with the flattened tree and the visibility queries in Scalar precision: room_model (float) for the
+		real-time builds, room_model_double for offline high-order renders. The BSP build itself always works on the
+		double precision PolygonSpatial geometry, only the query geometry and the query interface follow Scalar. The
+		double query planes come from the double normals and are evaluated in double (wall_plane_offset); corners are
+		the float corners of rts::wall in both precisions, exact for input vertices, rounded for split vertices.
+	*/
+	template <typename Scalar>
+	class basic_room_model {
 	public:
+		using scalar_type = Scalar;
+
 		// Used only during program initialization: load parameters from config files, disable walls accordingly.
 		std::vector<unsigned int> walls_to_disable;
 
-		// Walls used by the algorithms
+		// Walls used by the algorithms, pointing into source_walls (the copy of the input geometry owned by the room)
 		std::vector<rts::wall*> walls;
+		std::vector<rts::wall> source_walls;
+		// With BSPBuildOptions::merge_coplanar: the polygons the tree was built from and, by input wall, the input wall
+		// whose merged polygon it is part of (itself if not merged); both empty without
+		std::vector<rts::wall> merged_walls;
+		std::vector<uint32_t> merged_into;
+		// Polygon the fragments of an input wall are cut from, by input wall: its merged polygon or the wall itself
+		std::vector<rts::wall*> parent_walls;
 
 		// Walls created by the BSP algorithm
 		std::vector<rts::wall*> pwalls_BSP;
@@ -56,9 +250,66 @@ namespace rts {
 		std::vector<std::vector<rts::wall*>> plane_polygon_map;
 
 		// BSP-Tree + resulting height
-		const BSPNode* bsp_tree;
+		const BSPNode* bsp_tree = nullptr;
 		int bsp_tree_height = 0;
 
+		// Flattened BSP-Tree in one contiguous array (pre-order, front child first, root at index 0) and the shared
+		// array of pwalls_BSP indices the node wall ranges point into; used by the traversal code instead of bsp_tree
+		std::vector<FlatBSPNode> flat_bsp_nodes;
+		std::vector<uint32_t> flat_bsp_wall_indices;
+		// Node and wall planes plus wall corners of the flattened tree for the visibility queries
+		basic_bsp_query_geometry<Scalar> query_geometry;
+		// Cells of the flattened tree (assign_bsp_cells): cell of leaf / missing front child of node i at 2 * i, of its missing back child at 2 * i + 1
+		std::vector<uint32_t> node_cells;
+		uint32_t cell_count = 0;
+		// Potentially visible set, one row of pvs_row_words() words per cell; empty unless built with BSPBuildOptions::compute_pvs
+		std::vector<uint64_t> cell_pvs;
+		// Cells bordering the front side of wall i (dense index): [wall_cell_offsets[i], wall_cell_offsets[i + 1]) of wall_cells, with the PVS only
+		std::vector<uint32_t> wall_cell_offsets;
+		std::vector<uint32_t> wall_cells;
+
+		// Dense index (position in pwalls_BSP) of every wall created by the BSP algorithm
+		std::unordered_map<const rts::wall*, uint32_t> wall_index;
+		// pwalls_BSP indices of the fragments of walls[p]: [parent_fragment_offsets[p], parent_fragment_offsets[p + 1]) of parent_fragments
+		std::vector<uint32_t> parent_fragment_offsets;
+		std::vector<uint32_t> parent_fragments;
+		// Hierarchical ID of every wall created by the BSP algorithm, by dense index
+		std::vector<wall_uid> wall_uids;
+
+		// direct_reflectables and blockables of pwalls_BSP as bitsets over dense wall indices, same content as the lists for
+		// the entries that are in pwalls_BSP (build_wall_sets warns about others). Empty unless BSPBuildOptions::wall_bitsets
+		// is set, the lists are the primary form
+		std::vector<wall_bitset> reflectable_sets;
+		std::vector<wall_bitset> blockable_sets;
+
+		// Runtime enabled state of pwalls_BSP, one bit per dense wall index, see set_wall_enabled. Atomic, so walls can be
+		// toggled on a model other threads are querying
+		std::vector<std::atomic<uint64_t>> wall_enabled_mask;
+		// Enabled walls per plane-polygon map entry and the position of the first of them in the entry; entries without
+		// enabled walls produce no image sources
+		std::vector<std::atomic<uint32_t>> plane_enabled_count;
+		std::vector<std::atomic<uint32_t>> plane_representative;
+		// Serialises set_wall_enabled calls, queries never take it
+		std::mutex wall_state_mutex;
+		// Counts the set_wall_enabled calls that changed a wall, see wall_state_generation
+		std::atomic<uint64_t> wall_state_changes{ 0 };
+		// Position of every wall (dense index) in its plane-polygon map entry
+		std::vector<uint32_t> plane_slots;
+
+		// Statistics and phase timings of the last build
+		BuildStats build_stats;
+
+		// Counted by build_BSP (possibly from several pool threads) for build_stats
+		std::atomic<size_t> splits_performed{ 0 };
+		std::atomic<size_t> splitter_selections{ 0 };
+		std::atomic<size_t> ranta_eskola_fallbacks{ 0 };
+		std::atomic<size_t> classifier_mismatches{ 0 };
+		std::atomic<size_t> blockable_pair_tests{ 0 };
+		std::atomic<size_t> blockable_pair_tests_exhaustive{ 0 };
+
+		// Owns every PolygonSpatial, rts::wall and BSPNode created during the build, freed by reset_room_model
+		room_arena arena;
+
 		/*!
 			Construct and return Binary partitioning tree, to accelerate IS wall lookup / intersection
 
@@ -66,37 +317,85 @@ namespace rts {
 			The walls used to create the PolygonSpatial data structure used by the spatial partitioning algorithm
 			/param threshold 
 			The threshold for splitting up the room geometry, see Ranta-Eskola criterion
-		*/ 
-		const BSPNode* set_up_room_model(std::vector<rts::wall> polygons, const double threshold) {
-			
+			/param options
+			Build options, e.g. the parallel build mode; the resulting tree is the same for all of them
+		*/
+		const BSPNode* set_up_room_model(std::vector<rts::wall> polygons, const double threshold, const BSPBuildOptions& options = BSPBuildOptions()) {
+			// Rebuilding a room: drop the previous model, the arena keeps its first block for this build
+			reset_room_model();
+			build_stats = BuildStats();
+			splits_performed = 0;
+			splitter_selections = 0;
+			ranta_eskola_fallbacks = 0;
+			classifier_mismatches = 0;
+			blockable_pair_tests = 0;
+			blockable_pair_tests_exhaustive = 0;
+			auto phase_start = std::chrono::steady_clock::now();
+			// Seconds since the previous call (or the start of the build)
+			auto lap = [&phase_start]() {
+				const auto now = std::chrono::steady_clock::now();
+				const double seconds = std::chrono::duration<double>(now - phase_start).count();
+				phase_start = now;
+				return seconds;
+			};
+
 			// Transmogrify the rts::wall data structure to PolygonSpatial data structure for use in the algorithm
-			std::vector<PolygonSpatial*> polygonSpatialPartitioning = construct_polygonspatial_model(polygons);
-			for (int i = 0; i < polygons.size(); i++) {
-				walls.push_back(&(polygons[i]));
+			source_walls = std::move(polygons);
+			for (int i = 0; i < source_walls.size(); i++) {
+				walls.push_back(&(source_walls[i]));
+			}
+			merge_source_walls(options.merge_coplanar, options.plane_map_epsilon);
+			std::vector<PolygonSpatial*> polygonSpatialPartitioning;
+			if (options.merge_coplanar) {
+				build_stats.merge_input_polygons = (size_t)std::count_if(source_walls.begin(), source_walls.end(), [](const rts::wall& w) { return w.enabled; });
+				build_stats.merged_polygons = (size_t)std::count_if(merged_walls.begin(), merged_walls.end(), [](const rts::wall& w) { return w.enabled; });
+				BOOST_LOG_TRIVIAL(info) << "Coplanar merge: " << build_stats.merge_input_polygons << " polygons -> " << build_stats.merged_polygons << std::endl;
+				polygonSpatialPartitioning = construct_polygonspatial_model(merged_walls);
 			}
+			else
+				polygonSpatialPartitioning = construct_polygonspatial_model(source_walls);
+			build_stats.timings.polygon_conversion = lap();
 
 			// Use the newly built walls (PolygonSpatial) to create the Binary tree structure 
-			bsp_tree = build_BSP(polygonSpatialPartitioning, pwalls_BSP, threshold);
-
-			// Give new IDs + harmonise identifiers
-			for (int i = 0; i < walls.size(); i++) {
-				int monotone_id_increment = 0;
-				for (auto& j : pwalls_BSP) {
-					if (j->parent_id == i) {
-						j->setID(j->parent_id * 1000 + monotone_id_increment);
-						monotone_id_increment++;
-					}
-				}
+			if (options.parallel) {
+				task_pool pool(options.thread_count);
+				bsp_tree = build_BSP(polygonSpatialPartitioning, pwalls_BSP, threshold, options, &pool);
+			}
+			else
+				bsp_tree = build_BSP(polygonSpatialPartitioning, pwalls_BSP, threshold, options);
+			build_stats.timings.build_BSP = lap();
+
+			// Give new IDs + harmonise identifiers: index_walls groups the fragments by parent in one pass and numbers them
+			// in pwalls_BSP order, the IDs keep the parent_id * WALL_ID_FRAGMENTS + fragment scheme
+			index_walls();
+			size_t ambiguous_ids = 0;
+			for (size_t i = 0; i < pwalls_BSP.size(); ++i) {
+				const uint32_t fragment = wall_uid_fragment(wall_uids[i]);
+				pwalls_BSP[i]->setID(pwalls_BSP[i]->parent_id * WALL_ID_FRAGMENTS + fragment);
+				ambiguous_ids += fragment >= WALL_ID_FRAGMENTS;
 			}
+			if (ambiguous_ids)
+				BOOST_LOG_TRIVIAL(warning) << ambiguous_ids << " wall(s) of input walls split into more than " << WALL_ID_FRAGMENTS
+					<< " fragments share their ID with another wall, identify them by wall_uid" << std::endl;
+			build_stats.timings.id_harmonisation = lap();
 
 			// Construct plane-polygon map (critical operation to see which (new) walls are coplanar
-			create_plane_polygon_map(pwalls_BSP);
+			create_plane_polygon_map(pwalls_BSP, options.plane_map_epsilon);
+			build_stats.timings.plane_polygon_map = lap();
 
 			// Update blockables with new walls
 			for (size_t i = 0; i < pwalls_BSP.size(); ++i)
 				pwalls_BSP[i]->init_wall_state(&pwalls_BSP);
 
-			update_blockable_walls(&pwalls_BSP);
+			if (options.spatial_blockables)
+				update_blockable_walls_spatial(pwalls_BSP);
+			else
+				update_blockable_walls(&pwalls_BSP);
+			build_stats.timings.blockables = lap();
+			build_stats.blockable_pair_tests = blockable_pair_tests;
+			build_stats.blockable_pair_tests_exhaustive = blockable_pair_tests_exhaustive;
+			if (options.spatial_blockables)
+				BOOST_LOG_TRIVIAL(info) << "Spatial blockables: " << build_stats.blockable_pair_tests << " pair tests instead of " << build_stats.blockable_pair_tests_exhaustive << std::endl;
 
 			// Update direct_reflectables with the information from the plane polygon map 
 			// E.g. for each (coplanar) wall which other walls are able to reflect this walls sources
@@ -106,25 +405,54 @@ namespace rts {
 			for (auto& j : pwalls_BSP)
 				walls_BSP.push_back(*j);
 
-			// Make unify direct_reflectables for each plane polygon map entry and make them unique
+			// Unite the direct_reflectables of each plane polygon map entry, unique and sorted
+			std::vector<rts::wall*> direct_reflectables_list;
 			for (auto& i : plane_polygon_map) {
-				std::vector<rts::wall*> direct_reflectables_united;
-				for (auto& k : i) {
-					for (auto& j : k->direct_reflectables) {
-						direct_reflectables_united.push_back(j);
-					}
-				}
-				// Make direct_reflectables for new walls unique and sort them in lexicographic order
-				std::vector<rts::wall*>::iterator ip;
-				std::sort(direct_reflectables_united.begin(), direct_reflectables_united.end());
-				ip = std::unique(direct_reflectables_united.begin(), direct_reflectables_united.end());
-				direct_reflectables_united.resize(std::distance(direct_reflectables_united.begin(), ip));
-				i[0]->direct_reflectables = direct_reflectables_united;
+				direct_reflectables_list.clear();
+				for (auto& k : i)
+					direct_reflectables_list.insert(direct_reflectables_list.end(), k->direct_reflectables.begin(), k->direct_reflectables.end());
+				std::sort(direct_reflectables_list.begin(), direct_reflectables_list.end());
+				direct_reflectables_list.erase(std::unique(direct_reflectables_list.begin(), direct_reflectables_list.end()), direct_reflectables_list.end());
+				i[0]->direct_reflectables = direct_reflectables_list;
 			}
+			if (options.wall_bitsets)
+				build_wall_sets();
+			build_stats.timings.direct_reflectables = lap();
 
-			// Make sure tree structure is somewhat well formed and find out tree height, used for visited nodes buffer vector size estimation in backtracking_with_BSP
-			bsp_tree_height = traverseTree(bsp_tree);
-			BOOST_LOG_TRIVIAL(info) << "Done building BSP tree, tree height: " << bsp_tree_height << std::endl;
+			// Flatten the tree into one node array for the traversal code
+			flatten_BSP();
+			build_query_geometry();
+			build_cells();
+			init_wall_enabled_state();
+			build_stats.timings.post_passes = lap();
+
+			if (options.compute_pvs) {
+				build_pvs(options.pvs_step_budget, options.pvs_max_cells);
+				build_stats.timings.pvs = lap();
+			}
+
+			// Make sure tree structure is somewhat well formed and find out tree height, sizes the traversal stacks (bsp_traversal_stack)
+			bsp_tree_height = flat_bsp_nodes.empty() ? 0 : traverseFlatTree(0);
+			collect_build_stats();
+			build_stats.splits = splits_performed;
+			build_stats.splitter_selections = splitter_selections;
+			build_stats.ranta_eskola_fallbacks = ranta_eskola_fallbacks;
+			build_stats.classifier_mismatches = classifier_mismatches;
+			if (classifier_mismatches)
+				BOOST_LOG_TRIVIAL(warning) << classifier_mismatches << " polygon sides differ between classify_polygons and the whichSide() reference" << std::endl;
+			build_stats.ranta_eskola_fallback_rate = splitter_selections ? (double)ranta_eskola_fallbacks / (double)splitter_selections : 0.0;
+			BOOST_LOG_TRIVIAL(info) << "Done building BSP tree, tree height: " << bsp_tree_height << ", " << build_stats.node_count << " nodes, "
+				<< build_stats.leaf_count << " leaves, " << build_stats.splits << " splits, Ranta-Eskola fallback rate " << build_stats.ranta_eskola_fallback_rate << std::endl;
+			const room_arena::statistics arena_stats = arena.stats();
+			BOOST_LOG_TRIVIAL(info) << "BSP arena: " << arena_stats.allocations << " allocations (" << arena_stats.block_allocations << " from the heap), "
+				<< arena_stats.adopted << " adopted polygons, peak " << arena_stats.peak_bytes << " bytes in " << arena_stats.blocks << " block(s)" << std::endl;
+
+			if (options.sampled()) {
+				BOOST_LOG_TRIVIAL(info) << "Sampled splitter selection (" << options.splitter_candidates << " candidates, " << options.splitter_sample_size
+					<< " polygons sampled): " << flat_bsp_nodes.size() << " nodes, " << pwalls_BSP.size() << " walls from " << walls.size() << " polygons" << std::endl;
+				if (options.compare_with_full_search)
+					compare_with_full_search(threshold, options);
+			}
 
 #ifdef _DEBUG
 			// Check BSP-tree && correctness of splitting algorithm
@@ -135,34 +463,303 @@ namespace rts {
 			return bsp_tree;
 		}
 
-		const BSPNode* build_BSP(std::vector<PolygonSpatial*> polygons, std::vector<rts::wall*>& new_walls, const double threshold) {
+		/*!
+			Same as set_up_room_model, but the finished model is loaded from the binary cache at cache_path if that cache
+			was written for the same input, and written there after building otherwise. The cache key covers geometry,
+			disabled walls, threshold and every option that can change the tree.
+
+			/param materials_hash
+			Hash of the material data the walls refer to, e.g. hash_file() of the material configuration
+		*/
+		const BSPNode* set_up_room_model_cached(std::vector<rts::wall> polygons, const double threshold, const std::string& cache_path, const uint64_t materials_hash, const BSPBuildOptions& options = BSPBuildOptions()) {
+			const uint64_t key = room_model_hash(polygons, threshold, materials_hash, options);
+			if (load_bsp_cache(cache_path, key, polygons, options)) {
+				BOOST_LOG_TRIVIAL(info) << "Loaded BSP tree from cache " << cache_path << ", tree height: " << bsp_tree_height << std::endl;
+				return bsp_tree;
+			}
+			BOOST_LOG_TRIVIAL(info) << "No matching BSP cache at " << cache_path << ", building the room model" << std::endl;
+			set_up_room_model(std::move(polygons), threshold, options);
+			if (!save_bsp_cache(cache_path, key))
+				BOOST_LOG_TRIVIAL(warning) << "Could not write BSP cache " << cache_path << std::endl;
+			return bsp_tree;
+		}
+
+		// Content hash used as key of the BSP cache
+		uint64_t room_model_hash(const std::vector<rts::wall>& polygons, const double threshold, const uint64_t materials_hash, const BSPBuildOptions& options) const {
+			bsp_cache_hasher hasher;
+			hasher.add_value(BSP_CACHE_VERSION);
+			hasher.add_value(threshold);
+			hasher.add_value(materials_hash);
+			hasher.add_value((uint64_t)options.use_reference_classifier);
+			hasher.add_value((uint64_t)options.splitter_candidates);
+			hasher.add_value((uint64_t)options.splitter_selection);
+			hasher.add_value((uint64_t)options.splitter_sample_size);
+			hasher.add_value(options.splitter_seed);
+			hasher.add_value(options.plane_map_epsilon);
+			hasher.add_value((uint64_t)options.spatial_blockables);
+			hasher.add_value((uint64_t)options.compute_pvs);
+			hasher.add_value((uint64_t)(options.compute_pvs ? options.pvs_step_budget : 0));
+			hasher.add_value((uint64_t)(options.compute_pvs ? options.pvs_max_cells : 0));
+			hasher.add_value((uint64_t)options.merge_coplanar);
+			for (auto i : walls_to_disable)
+				hasher.add_value((uint64_t)i);
+			for (auto& i : polygons) {
+				hasher.add_value((uint64_t)i.id);
+				hasher.add_value((uint64_t)i.enabled);
+				hasher.add_value((uint64_t)i.corners.size());
+				for (auto& j : i.corners)
+					for (int k = 0; k < 3; k++)
+						hasher.add_value((float)j[k]);
+				for (int k = 0; k < 3; k++)
+					hasher.add_value((float)i.n.at(k));
+				hasher.add_value((double)i.d);
+			}
+			return hasher.value();
+		}
+
+		/*!
+			Write the finished model to path: walls, flattened tree, IDs, plane_polygon_map, direct_reflectables, blockables and the PVS
+		*/
+		bool save_bsp_cache(const std::string& path, const uint64_t key) const {
+			bsp_cache_writer writer;
+			std::vector<bsp_cache_wall> cached_walls;
+			std::vector<float> corners;
+			for (auto i : pwalls_BSP) {
+				cached_walls.push_back(bsp_cache_wall{ (uint32_t)i->id, (uint32_t)i->parent_id, (int32_t)i->plane_polygon_map_id, (uint32_t)(corners.size() / 3), (uint32_t)i->corners.size(), (uint32_t)i->enabled });
+				for (auto& j : i->corners)
+					for (int k = 0; k < 3; k++)
+						corners.push_back(j[k]);
+			}
+			writer.section(BSP_CACHE_WALLS, cached_walls);
+			writer.section(BSP_CACHE_CORNERS, corners);
+
+			std::vector<bsp_cache_node> nodes;
+			for (auto& i : flat_bsp_nodes)
+				nodes.push_back(bsp_cache_node{ i.front, i.back, i.wall_offset, i.wall_count, (uint32_t)i.leaf_node });
+			writer.section(BSP_CACHE_NODES, nodes);
+			writer.section(BSP_CACHE_NODE_WALLS, flat_bsp_wall_indices);
+
+			// Wall lists are stored as offsets + indices into pwalls_BSP, walls outside pwalls_BSP cannot be cached
+			bool complete = true;
+			auto write_lists = [&](const bsp_cache_section_id offsets_id, const bsp_cache_section_id values_id, const size_t list_count, auto list_at) {
+				std::vector<uint32_t> offsets{ 0 }, values;
+				for (size_t i = 0; i < list_count; ++i) {
+					for (auto j : list_at(i)) {
+						auto index = wall_index.find(j);
+						if (index == wall_index.end())
+							complete = false;
+						else
+							values.push_back(index->second);
+					}
+					offsets.push_back((uint32_t)values.size());
+				}
+				writer.section(offsets_id, offsets);
+				writer.section(values_id, values);
+			};
+			write_lists(BSP_CACHE_PLANE_MAP_OFFSETS, BSP_CACHE_PLANE_MAP_WALLS, plane_polygon_map.size(), [this](size_t i) -> const std::vector<rts::wall*>& { return plane_polygon_map[i]; });
+			write_lists(BSP_CACHE_REFLECTABLES_OFFSETS, BSP_CACHE_REFLECTABLES, pwalls_BSP.size(), [this](size_t i) -> const std::vector<rts::wall*>& { return pwalls_BSP[i]->direct_reflectables; });
+			write_lists(BSP_CACHE_COPY_REFLECTABLES_OFFSETS, BSP_CACHE_COPY_REFLECTABLES, walls_BSP.size(), [this](size_t i) -> const std::vector<rts::wall*>& { return walls_BSP[i].direct_reflectables; });
+			write_lists(BSP_CACHE_BLOCKABLES_OFFSETS, BSP_CACHE_BLOCKABLES, pwalls_BSP.size(), [this](size_t i) -> const std::vector<rts::wall*>& { return pwalls_BSP[i]->blockables; });
+			// Cells are numbered from the tree alone, only the PVS rows need storing
+			writer.section(BSP_CACHE_CELL_PVS, cell_pvs);
+			if (!complete)
+				return false;
+			return writer.write(path, key, bsp_tree_height);
+		}
+
+		/*!
+			Restore the model written by save_bsp_cache. Everything is validated before the current model is replaced,
+			returns false (model untouched) for a missing, stale or damaged cache. options has to be the one the cache was
+			built with, the coplanar merge of the input walls is not stored and runs again.
+		*/
+		bool load_bsp_cache(const std::string& path, const uint64_t key, const std::vector<rts::wall>& polygons, const BSPBuildOptions& options = BSPBuildOptions()) {
+			bsp_cache_reader reader;
+			if (!reader.open(path, key))
+				return false;
+			size_t wall_count, corner_count, node_count, node_wall_count;
+			const bsp_cache_wall* cached_walls = reader.section<bsp_cache_wall>(BSP_CACHE_WALLS, wall_count);
+			const float* corners = reader.section<float>(BSP_CACHE_CORNERS, corner_count);
+			const bsp_cache_node* nodes = reader.section<bsp_cache_node>(BSP_CACHE_NODES, node_count);
+			const uint32_t* node_walls = reader.section<uint32_t>(BSP_CACHE_NODE_WALLS, node_wall_count);
+			if (!cached_walls || !corners || !nodes || !node_walls)
+				return false;
+			for (size_t i = 0; i < wall_count; ++i) {
+				if (cached_walls[i].parent_id >= polygons.size() || ((size_t)cached_walls[i].corner_offset + cached_walls[i].corner_count) * 3 > corner_count)
+					return false;
+			}
+			// IDs have to follow the parent_id * WALL_ID_FRAGMENTS + fragment numbering index_walls reproduces
+			std::vector<uint32_t> next_fragment(polygons.size(), 0);
+			for (size_t i = 0; i < wall_count; ++i)
+				if (cached_walls[i].id != cached_walls[i].parent_id * WALL_ID_FRAGMENTS + next_fragment[cached_walls[i].parent_id]++)
+					return false;
+			// Pre-order layout: children always come after their parent, which also rules out cycles
+			for (size_t i = 0; i < node_count; ++i) {
+				if ((nodes[i].front != BSP_NULL_INDEX && (nodes[i].front <= i || nodes[i].front >= node_count))
+					|| (nodes[i].back != BSP_NULL_INDEX && (nodes[i].back <= i || nodes[i].back >= node_count))
+					|| (size_t)nodes[i].wall_offset + nodes[i].wall_count > node_wall_count)
+					return false;
+			}
+			for (size_t i = 0; i < node_wall_count; ++i)
+				if (node_walls[i] >= wall_count)
+					return false;
+			// Height as traverseFlatTree counts it; children come later, so one backwards pass sees them first
+			std::vector<int> heights(node_count, 0);
+			for (size_t i = node_count; i-- > 0;)
+				heights[i] = 1 + std::max(nodes[i].front != BSP_NULL_INDEX ? heights[nodes[i].front] : 0, nodes[i].back != BSP_NULL_INDEX ? heights[nodes[i].back] : 0);
+			if (reader.tree_height() != (node_count ? heights[0] : 0))
+				return false;
+			struct index_lists {
+				const uint32_t* offsets = nullptr;
+				const uint32_t* values = nullptr;
+				size_t count = 0;
+			};
+			auto read_lists = [&](const bsp_cache_section_id offsets_id, const bsp_cache_section_id values_id, index_lists& lists) {
+				size_t offset_count, value_count;
+				lists.offsets = reader.section<uint32_t>(offsets_id, offset_count);
+				lists.values = reader.section<uint32_t>(values_id, value_count);
+				if (!lists.offsets || !lists.values || offset_count == 0 || lists.offsets[0] != 0 || lists.offsets[offset_count - 1] != value_count)
+					return false;
+				for (size_t i = 1; i < offset_count; ++i)
+					if (lists.offsets[i] < lists.offsets[i - 1])
+						return false;
+				for (size_t i = 0; i < value_count; ++i)
+					if (lists.values[i] >= wall_count)
+						return false;
+				lists.count = offset_count - 1;
+				return true;
+			};
+			index_lists plane_map, reflectables, copy_reflectables, blockables;
+			if (!read_lists(BSP_CACHE_PLANE_MAP_OFFSETS, BSP_CACHE_PLANE_MAP_WALLS, plane_map)
+				|| !read_lists(BSP_CACHE_REFLECTABLES_OFFSETS, BSP_CACHE_REFLECTABLES, reflectables) || reflectables.count != wall_count
+				|| !read_lists(BSP_CACHE_COPY_REFLECTABLES_OFFSETS, BSP_CACHE_COPY_REFLECTABLES, copy_reflectables) || copy_reflectables.count != wall_count
+				|| !read_lists(BSP_CACHE_BLOCKABLES_OFFSETS, BSP_CACHE_BLOCKABLES, blockables) || blockables.count != wall_count)
+				return false;
+			// Every plane-polygon map entry has a first wall (plane_reflectables), every wall an entry
+			for (size_t i = 0; i < plane_map.count; ++i)
+				if (plane_map.offsets[i + 1] == plane_map.offsets[i])
+					return false;
+			for (size_t i = 0; i < wall_count; ++i)
+				if (cached_walls[i].plane_polygon_map_id < 0 || (size_t)cached_walls[i].plane_polygon_map_id >= plane_map.count)
+					return false;
+			size_t pvs_word_count;
+			const uint64_t* pvs = reader.section<uint64_t>(BSP_CACHE_CELL_PVS, pvs_word_count);
+			// A PVS has to have one row per cell of the tree, counted the way assign_bsp_cells numbers them
+			size_t cached_cell_count = 0;
+			for (size_t i = 0; i < node_count; ++i)
+				cached_cell_count += nodes[i].leaf_node ? 1 : (nodes[i].front == BSP_NULL_INDEX) + (nodes[i].back == BSP_NULL_INDEX);
+			if (!pvs || (pvs_word_count && pvs_word_count != cached_cell_count * ((cached_cell_count + 63) / 64)))
+				return false;
+
+			reset_room_model();
+			source_walls = polygons;
+			for (auto& i : source_walls)
+				walls.push_back(&i);
+			merge_source_walls(options.merge_coplanar, options.plane_map_epsilon);
+
+			// Walls take normal and distance from their parent, exactly like construct_rtswall_model
+			for (size_t i = 0; i < wall_count; ++i) {
+				const bsp_cache_wall& cached = cached_walls[i];
+				std::vector<arma::fvec3> arma_vecs;
+				for (uint32_t k = 0; k < cached.corner_count; ++k) {
+					const float* corner = corners + 3 * ((size_t)cached.corner_offset + k);
+					arma_vecs.push_back(arma::fvec3{ corner[0], corner[1], corner[2] });
+				}
+				rts::wall* myWall = arena.create<rts::wall>(cached.id, arma_vecs, walls[cached.parent_id]->material, true, true);
+				myWall->n = walls[cached.parent_id]->n;
+				myWall->double_n = walls[cached.parent_id]->double_n;
+				myWall->d = walls[cached.parent_id]->d;
+				myWall->setParentID(cached.parent_id);
+				myWall->setParent(parent_walls[cached.parent_id]);
+				myWall->enabled = cached.enabled != 0;
+				myWall->plane_polygon_map_id = cached.plane_polygon_map_id;
+				pwalls_BSP.push_back(myWall);
+			}
+			index_walls();
+
+			flat_bsp_nodes.reserve(node_count);
+			for (size_t i = 0; i < node_count; ++i)
+				flat_bsp_nodes.push_back(FlatBSPNode{ nodes[i].front, nodes[i].back, nodes[i].wall_offset, nodes[i].wall_count, nodes[i].leaf_node != 0 });
+			flat_bsp_wall_indices.assign(node_walls, node_walls + node_wall_count);
+			bsp_tree = node_count ? rebuild_BSP_node(0) : nullptr;
+			bsp_tree_height = reader.tree_height();
+			build_stats = BuildStats();
+			build_stats.from_cache = true;
+
+			auto list = [this](const index_lists& lists, size_t i) {
+				std::vector<rts::wall*> result;
+				for (uint32_t k = lists.offsets[i]; k < lists.offsets[i + 1]; ++k)
+					result.push_back(pwalls_BSP[lists.values[k]]);
+				return result;
+			};
+			for (size_t i = 0; i < plane_map.count; ++i)
+				plane_polygon_map.push_back(list(plane_map, i));
+			// direct_reflectables and blockables are the wall state init_wall_state and the build compute, both come
+			// from the cache, so the quadratic init_wall_state pass of a build is not repeated
+			for (size_t i = 0; i < wall_count; ++i) {
+				pwalls_BSP[i]->blockables = list(blockables, i);
+				pwalls_BSP[i]->direct_reflectables = list(copy_reflectables, i);
+			}
+			// walls_BSP copies are taken before the direct_reflectables of the plane-polygon map entries are united
+			for (auto& j : pwalls_BSP)
+				walls_BSP.push_back(*j);
+			for (size_t i = 0; i < wall_count; ++i)
+				pwalls_BSP[i]->direct_reflectables = list(reflectables, i);
+			if (options.wall_bitsets)
+				build_wall_sets();
+			build_query_geometry();
+			build_cells();
+			init_wall_enabled_state();
+			if (pvs_word_count) {
+				cell_pvs.assign(pvs, pvs + pvs_word_count);
+				build_wall_cells();
+			}
+			collect_build_stats();
+			return true;
+		}
+
+		// Recreate the pointer based tree from the flattened one
+		const BSPNode* rebuild_BSP_node(const uint32_t index) {
+			const FlatBSPNode& node = flat_bsp_nodes[index];
+			std::vector<rts::wall*> node_walls;
+			for (uint32_t k = 0; k < node.wall_count; ++k)
+				node_walls.push_back(flat_node_wall(node, k));
+			const BSPNode* front = node.front != BSP_NULL_INDEX ? rebuild_BSP_node(node.front) : nullptr;
+			const BSPNode* back = node.back != BSP_NULL_INDEX ? rebuild_BSP_node(node.back) : nullptr;
+			return arena.create<BSPNode>(node_walls, front, back, node.leaf_node);
+		}
+
+		/*!
+			Recursively build the BSP tree for polygons, appending every wall created for the subtree to new_walls
+
+			/param pool
+			If set, front subtrees with at least options.parallel_grain_size polygons are built as tasks on the pool.
+			Each side collects its walls separately and they are appended in the serial order (front, back, node) once
+			both are done, so tree, walls and their order are the same as for the serial build
+		*/
+		const BSPNode* build_BSP(std::vector<PolygonSpatial*> polygons, std::vector<rts::wall*>& new_walls, const double threshold, const BSPBuildOptions& options = BSPBuildOptions(), task_pool* pool = nullptr) {
 			// Check for convexity, then terminate, otherwise continue to build
 			if (polygons.empty()) {
 				return nullptr;
 			}
 
-			// Check convexity of polygons, if subspace spanned by polygons convex -> return 
-			bool subspace_convex = true;
-			for (auto i : polygons) {
-				for (auto j : polygons) {
-					if (i == j)
-						continue;
-					DEdge* edge_to_check = j->first();
-					for (int k = 0; k < j->nPoints(); k++) {
-						if (i->plane().whichSide(edge_to_check->srcPoint()) == BELOW) {
-							subspace_convex = false;
-							break;
-						}
-						edge_to_check = edge_to_check->next();
-					}
-					if (!subspace_convex)
-						break;
-				}
+			// Classify all polygons against all polygon planes in a single pass; the convexity check and the
+			// Ranta-Eskola measures below are both derived from it
+			//vector counting in (wall-id; behind; front; crosses/r(s)) for polygons
+			std::vector<std::tuple<int, int, int, int>> measures;
+			std::vector<int> candidates, sample;
+			bool subspace_convex;
+			if (select_splitter_sample(polygons, options, candidates, sample)) {
+				// Estimates on a subset cannot prove convexity, that check stays exact
+				subspace_convex = is_subspace_convex(polygons, options);
 				if (!subspace_convex)
-					break;
+					classify_level(polygons, candidates, sample, options, measures);
 			}
+			else
+				subspace_convex = classify_level(polygons, candidates, sample, options, measures);
+
+			// If subspace spanned by polygons convex -> return 
 			if (subspace_convex) {
-				const BSPNode* node = new BSPNode{ construct_rtswall_model(polygons), nullptr, nullptr, true };
+				const BSPNode* node = arena.create<BSPNode>(construct_rtswall_model(polygons), nullptr, nullptr, true);
 				for (auto j : node->node_walls)
 					new_walls.push_back(j);
 				return node;
@@ -170,39 +767,6 @@ namespace rts {
 			// Check, which wall is best for splitting:
 			// using r(p) && r(s) criterion Real-Time Processing of Image Sources Using Binary Space Partitioning on pg. 5/608
 			// calculate r(p) with criterion of Ranta-Eskola
-			//vector counting in (wall-id; behind; front; crosses/r(s)) for polygons
-			std::vector<std::tuple<int, int, int, int>> measures;
-			int temp_id = 0;
-			for (auto& i : polygons) {
-				measures.push_back(std::tuple<int, int, int, int>(temp_id, 0, 0, 0));
-				for (auto& j : polygons) {
-					if (i == j)
-						continue;
-					bool behind = false;
-					bool in_front = false;
-					DEdge* edge_to_check = j->first();
-					for (int k = 0; k < j->nPoints(); k++) {
-						if (i->plane().whichSide(edge_to_check->srcPoint()) == BELOW)
-							behind = true;
-						if (i->plane().whichSide(edge_to_check->srcPoint()) == ABOVE)
-							in_front = true;
-						edge_to_check = edge_to_check->next();
-					}
-					// if i in front of j -> infront += 1
-					if (behind && !in_front)
-						std::get<1>(measures.back()) += 1;
-					// if i behind of j -> behind += 1
-					if (!behind && in_front)
-						std::get<2>(measures.back()) += 1;
-					// if i crosses j -> crosses += 1
-					if (behind && in_front)
-						std::get<3>(measures.back()) += 1;
-					// if i is ON j -> default case: in_front += 1
-					if (!behind && !in_front)
-						std::get<2>(measures.back()) += 1;
-				}
-				temp_id += 1;
-			}
 			// select splitting plane 
 			std::vector<std::tuple<int, double, int>> r_p;
 			for (auto& i : measures) {
@@ -224,6 +788,7 @@ namespace rts {
 				{
 					return std::get<2>(x) < std::get<2>(y);
 				});
+			splitter_selections++;
 			int wall_id = -1;
 			for (auto& i : r_p) {
 				// If number of crosses minimal and threshold criterion met -> use as partition wall
@@ -236,6 +801,7 @@ namespace rts {
 			// If no wall manages to satisfy the given Ranta-Eskola criterion threshold 
 			// we default to to the element with the smallest difference to the criterion
 			if (wall_id == -1) {
+				ranta_eskola_fallbacks++;
 				for (auto& i : r_p) {
 					std::get<1>(i) = abs(std::get<1>(i) - threshold);
 				}
@@ -266,13 +832,44 @@ namespace rts {
 				on_polys.push_back(getItem(PolygonSpatial));
 			forEachItemOnList(below)
 				below_polys.push_back(getItem(PolygonSpatial));
+			// Pieces created by split() are not owned by the arena yet, the polygons of this level already are
+			adopt_split_polygons(polygons, above_polys);
+			adopt_split_polygons(polygons, on_polys);
+			adopt_split_polygons(polygons, below_polys);
+			// Every split turns one polygon into two pieces
+			splits_performed += above_polys.size() + on_polys.size() + below_polys.size() - polygons.size();
 
 			// Transmogrify the PolygonSpatial data structure back to rts::wall for use in the algorithm
 			std::vector<rts::wall*> sortedWalls = construct_rtswall_model(on_polys);
-			update_blockable_walls(&sortedWalls);
+			if (options.spatial_blockables)
+				update_blockable_walls_spatial(sortedWalls);
+			else
+				update_blockable_walls(&sortedWalls);
 			const std::vector<rts::wall*> myWalls = sortedWalls;
 			// Create binary tree node recursively
-			const BSPNode* node = new BSPNode{ myWalls, build_BSP(above_polys, new_walls, threshold), build_BSP(below_polys, new_walls, threshold), false };
+			const BSPNode* front = nullptr;
+			const BSPNode* back = nullptr;
+			if (pool && above_polys.size() >= options.parallel_grain_size && !below_polys.empty()) {
+				std::vector<rts::wall*> front_walls, back_walls;
+				task_pool::task_group group;
+				pool->run(group, [&]() { front = build_BSP(above_polys, front_walls, threshold, options, pool); });
+				// The front task references this frame, so it has to be joined even if the back subtree throws
+				try {
+					back = build_BSP(below_polys, back_walls, threshold, options, pool);
+				}
+				catch (...) {
+					pool->wait(group);
+					throw;
+				}
+				pool->wait(group);
+				new_walls.insert(new_walls.end(), front_walls.begin(), front_walls.end());
+				new_walls.insert(new_walls.end(), back_walls.begin(), back_walls.end());
+			}
+			else {
+				front = build_BSP(above_polys, new_walls, threshold, options, pool);
+				back = build_BSP(below_polys, new_walls, threshold, options, pool);
+			}
+			const BSPNode* node = arena.create<BSPNode>(myWalls, front, back, false);
 
 			for (auto j : node->node_walls)
 				new_walls.push_back(j);
@@ -286,6 +883,248 @@ namespace rts {
 			return node;
 		}
 
+		/*!
+			Classify the sampled polygons of a recursion level against the plane of every candidate and reduce each row
+			of that classification matrix to the (wall-id; behind; front; crosses) measures right away, so only O(n)
+			memory is needed. With the full search (all polygons as candidates and sample) the return value tells
+			whether the subspace spanned by polygons is convex, i.e. no polygon has a vertex below the plane of another
+			one (no row counted anything behind or crossing).
+		*/
+		bool classify_level(const std::vector<PolygonSpatial*>& polygons, const std::vector<int>& candidates, const std::vector<int>& sample, const BSPBuildOptions& options, std::vector<std::tuple<int, int, int, int>>& measures) {
+			std::vector<PolygonSpatial*> sample_polygons;
+			sample_polygons.reserve(sample.size());
+			for (auto j : sample)
+				sample_polygons.push_back(polygons[j]);
+			// Pack the vertices of this level once, each candidate plane is then classified against all polygons in one call
+			polygon_vertex_soa level_vertices;
+			pack_polygon_vertices(sample_polygons, level_vertices);
+			std::vector<uint8_t> sides(sample_polygons.size());
+			std::vector<uint8_t> vertex_codes;
+			bool subspace_convex = true;
+			measures.clear();
+			measures.reserve(candidates.size());
+			for (auto i : candidates) {
+				measures.push_back(std::tuple<int, int, int, int>(i, 0, 0, 0));
+				if (options.use_reference_classifier)
+					classify_polygons_reference(polygons[i], sample_polygons, sides.data());
+				else
+					classify_polygons(plane_coefficients_of(polygons[i]->plane()), level_vertices, sides.data(), vertex_codes);
+				if (options.verify_classifier)
+					verify_classification(polygons[i], sample_polygons, level_vertices);
+				for (size_t j = 0; j < sample.size(); j++) {
+					if (sample[j] == i)
+						continue;
+					const bool behind = (sides[j] & SIDE_BELOW) != 0;
+					const bool in_front = (sides[j] & SIDE_ABOVE) != 0;
+					// if i in front of j -> infront += 1
+					if (behind && !in_front)
+						std::get<1>(measures.back()) += 1;
+					// if i behind of j -> behind += 1
+					if (!behind && in_front)
+						std::get<2>(measures.back()) += 1;
+					// if i crosses j -> crosses += 1
+					if (behind && in_front)
+						std::get<3>(measures.back()) += 1;
+					// if i is ON j -> default case: in_front += 1
+					if (!behind && !in_front)
+						std::get<2>(measures.back()) += 1;
+				}
+				if (std::get<1>(measures.back()) != 0 || std::get<3>(measures.back()) != 0)
+					subspace_convex = false;
+			}
+			return subspace_convex;
+		}
+
+		/*!
+			Exact convexity check for the sampled build, stops at the first polygon found below another polygon's plane
+		*/
+		bool is_subspace_convex(const std::vector<PolygonSpatial*>& polygons, const BSPBuildOptions& options) {
+			polygon_vertex_soa level_vertices;
+			pack_polygon_vertices(polygons, level_vertices);
+			std::vector<uint8_t> sides(polygons.size());
+			std::vector<uint8_t> vertex_codes;
+			for (size_t i = 0; i < polygons.size(); i++) {
+				if (options.use_reference_classifier)
+					classify_polygons_reference(polygons[i], polygons, sides.data());
+				else
+					classify_polygons(plane_coefficients_of(polygons[i]->plane()), level_vertices, sides.data(), vertex_codes);
+				if (options.verify_classifier)
+					verify_classification(polygons[i], polygons, level_vertices);
+				for (size_t j = 0; j < polygons.size(); j++) {
+					if (i != j && (sides[j] & SIDE_BELOW))
+						return false;
+				}
+			}
+			return true;
+		}
+
+		/*!
+			Choose the splitter candidates and the polygons used to score them. Returns false (and all polygons as
+			candidates and sample) if the options ask for the full search or the node is small enough for it.
+		*/
+		static bool select_splitter_sample(const std::vector<PolygonSpatial*>& polygons, const BSPBuildOptions& options, std::vector<int>& candidates, std::vector<int>& sample) {
+			const size_t n = polygons.size();
+			candidates.resize(n);
+			std::iota(candidates.begin(), candidates.end(), 0);
+			sample = candidates;
+			const bool sample_candidates = options.splitter_candidates != 0 && options.splitter_candidates < n;
+			const bool sample_polygons = options.splitter_sample_size != 0 && options.splitter_sample_size < n;
+			if (!sample_candidates && !sample_polygons)
+				return false;
+
+			// Seeded from the node's polygons only, independent of the order subtrees are built in
+			std::seed_seq seed{ options.splitter_seed, (uint32_t)n, (uint32_t)polygons.front()->m_parentID, (uint32_t)polygons.back()->m_parentID };
+			std::mt19937 rng(seed);
+			if (sample_candidates) {
+				if (options.splitter_selection == BSPSplitterSelection::largest_area) {
+					std::vector<double> area(n);
+					for (size_t i = 0; i < n; ++i)
+						area[i] = polygon_area(polygons[i]);
+					std::nth_element(candidates.begin(), candidates.begin() + options.splitter_candidates, candidates.end(), [&area](int x, int y) {
+						return area[x] > area[y] || (area[x] == area[y] && x < y);
+					});
+					candidates.resize(options.splitter_candidates);
+					std::sort(candidates.begin(), candidates.end());
+				}
+				else
+					partial_shuffle(candidates, options.splitter_candidates, rng);
+			}
+			if (sample_polygons)
+				partial_shuffle(sample, options.splitter_sample_size, rng);
+			return true;
+		}
+
+		// Keep k randomly chosen elements of indices (partial Fisher-Yates), in ascending order
+		static void partial_shuffle(std::vector<int>& indices, const size_t k, std::mt19937& rng) {
+			for (size_t i = 0; i < k; ++i) {
+				std::uniform_int_distribution<size_t> pick(i, indices.size() - 1);
+				std::swap(indices[i], indices[pick(rng)]);
+			}
+			indices.resize(k);
+			std::sort(indices.begin(), indices.end());
+		}
+
+		// Area of a planar polygon (Newell's method)
+		static double polygon_area(PolygonSpatial* polygon) {
+			double nx = 0.0, ny = 0.0, nz = 0.0;
+			DEdge* edge = polygon->first();
+			for (int k = 0; k < polygon->nPoints(); k++) {
+				const Point& p = edge->srcPoint();
+				const Point& q = edge->next()->srcPoint();
+				nx += (p.y() - q.y()) * (p.z() + q.z());
+				ny += (p.z() - q.z()) * (p.x() + q.x());
+				nz += (p.x() - q.x()) * (p.y() + q.y());
+				edge = edge->next();
+			}
+			return 0.5 * std::sqrt(nx * nx + ny * ny + nz * nz);
+		}
+
+		/*
+		* Build the same room with the full splitter search and log both trees side by side
+		*/
+		void compare_with_full_search(const double threshold, const BSPBuildOptions& options) {
+			BSPBuildOptions full_options = options;
+			full_options.splitter_candidates = 0;
+			full_options.splitter_sample_size = 0;
+			full_options.compare_with_full_search = false;
+			basic_room_model full_search;
+			full_search.walls_to_disable = walls_to_disable;
+			full_search.set_up_room_model(source_walls, threshold, full_options);
+			BOOST_LOG_TRIVIAL(info) << "Sampled vs. full splitter search: tree height " << bsp_tree_height << " / " << full_search.bsp_tree_height
+				<< ", nodes " << flat_bsp_nodes.size() << " / " << full_search.flat_bsp_nodes.size()
+				<< ", walls after splitting " << pwalls_BSP.size() << " / " << full_search.pwalls_BSP.size() << std::endl;
+		}
+
+		// Pack the vertices of polygons into the structure of arrays consumed by classify_polygons
+		static void pack_polygon_vertices(const std::vector<PolygonSpatial*>& polygons, polygon_vertex_soa& vertices) {
+			vertices.clear();
+			for (auto i : polygons) {
+				DEdge* edge = i->first();
+				for (int k = 0; k < i->nPoints(); k++) {
+					vertices.add_vertex(edge->srcPoint().x(), edge->srcPoint().y(), edge->srcPoint().z());
+					edge = edge->next();
+				}
+				vertices.end_polygon();
+			}
+		}
+
+		static plane_coefficients plane_coefficients_of(const Plane& plane) {
+			return plane_coefficients{ plane.normal().x(), plane.normal().y(), plane.normal().z(), plane.d() };
+		}
+
+		// Reference implementation of classify_polygons: the per-vertex whichSide() walk over the DEdge lists
+		static void classify_polygons_reference(PolygonSpatial* splitter, const std::vector<PolygonSpatial*>& polygons, uint8_t* sides) {
+			for (size_t j = 0; j < polygons.size(); j++) {
+				uint8_t side = SIDE_ON;
+				DEdge* edge_to_check = polygons[j]->first();
+				for (int k = 0; k < polygons[j]->nPoints(); k++) {
+					const auto where = splitter->plane().whichSide(edge_to_check->srcPoint());
+					if (where == BELOW)
+						side |= SIDE_BELOW;
+					if (where == ABOVE)
+						side |= SIDE_ABOVE;
+					edge_to_check = edge_to_check->next();
+				}
+				sides[j] = side;
+			}
+		}
+
+		// Count the polygons on which any classify_polygons path this CPU supports disagrees with the reference
+		void verify_classification(PolygonSpatial* splitter, const std::vector<PolygonSpatial*>& polygons, const polygon_vertex_soa& vertices) {
+			std::vector<uint8_t> reference(polygons.size()), sides(polygons.size()), vertex_codes;
+			classify_polygons_reference(splitter, polygons, reference.data());
+			size_t mismatches = 0;
+			for (auto isa : { classifier_isa::scalar, classifier_isa::sse2, classifier_isa::avx2 }) {
+				if (!classifier_isa_supported(isa))
+					continue;
+				classify_polygons(plane_coefficients_of(splitter->plane()), vertices, sides.data(), vertex_codes, PLANE_SIDE_EPSILON, isa);
+				for (size_t j = 0; j < polygons.size(); ++j)
+					mismatches += sides[j] != reference[j];
+			}
+			classifier_mismatches += mismatches;
+		}
+
+		void adopt_split_polygons(const std::vector<PolygonSpatial*>& level_polygons, const std::vector<PolygonSpatial*>& pieces) {
+			std::unordered_set<const PolygonSpatial*> owned(level_polygons.begin(), level_polygons.end());
+			for (auto i : pieces)
+				if (owned.find(i) == owned.end())
+					arena.adopt(i);
+		}
+
+		/*
+		* Free everything built by set_up_room_model, so the room can be rebuilt without leaking
+		*/
+		void reset_room_model() {
+			bsp_tree = nullptr;
+			bsp_tree_height = 0;
+			walls.clear();
+			merged_walls.clear();
+			merged_into.clear();
+			parent_walls.clear();
+			pwalls_BSP.clear();
+			walls_BSP.clear();
+			plane_polygon_map.clear();
+			flat_bsp_nodes.clear();
+			flat_bsp_wall_indices.clear();
+			query_geometry.clear();
+			node_cells.clear();
+			cell_count = 0;
+			cell_pvs.clear();
+			wall_cell_offsets.clear();
+			wall_cells.clear();
+			wall_index.clear();
+			parent_fragment_offsets.clear();
+			parent_fragments.clear();
+			wall_uids.clear();
+			reflectable_sets.clear();
+			blockable_sets.clear();
+			wall_enabled_mask.clear();
+			plane_enabled_count.clear();
+			plane_representative.clear();
+			plane_slots.clear();
+			arena.reset();
+		}
+
 		/*
 		* disable walls marked in the config file; used only during initialization
 		*/
@@ -296,42 +1135,52 @@ namespace rts {
 		}
 
 		// Plane-Polygon Map as per Schroeder_Dirk_Diss_Physically_based_real_time_auralization.pdf (pg. 116)
-		void create_plane_polygon_map(std::vector<rts::wall*> walls_to_check) {
+		// Walls are hashed by their plane (n, d) quantised to epsilon, so each wall only looks at the entries in its own
+		// and the neighbouring buckets instead of at every entry. Two planes match if n and d agree within epsilon,
+		// epsilon = 0 keeps the exact comparison (bit patterns, so -0 and 0 still differ).
+		void create_plane_polygon_map(std::vector<rts::wall*> walls_to_check, const double epsilon = PLANE_MAP_EPSILON) {
+			if (walls_to_check.empty())
+				return;
 			// Sort according to id for easier analysis down the line && backwards compatibility
 			struct {
 				bool operator()(rts::wall* a, rts::wall* b) const { return a->id < b->id; }
 			} comparator;
 			std::sort(walls_to_check.begin(), walls_to_check.end(), comparator);
-			plane_polygon_map.push_back({ walls_to_check[0] });
-			plane_polygon_map[0][0]->plane_polygon_map_id = 0;
-			for (auto& one_wall : walls_to_check) {
+
+			std::unordered_map<plane_key, std::vector<int>, plane_key_hash> buckets;
+			buckets.reserve(walls_to_check.size());
+			auto add_entry = [&](rts::wall* one_wall) {
+				one_wall->plane_polygon_map_id = (int)plane_polygon_map.size();
+				buckets[make_plane_key(one_wall, epsilon)].push_back((int)plane_polygon_map.size());
+				plane_polygon_map.push_back({ one_wall });
+			};
+			add_entry(walls_to_check[0]);
+			for (size_t w = 1; w < walls_to_check.size(); ++w) {
+				rts::wall* one_wall = walls_to_check[w];
 				if (!one_wall->enabled) continue;
-				for (int i = 0; i < plane_polygon_map.size(); i++) {
-					if (one_wall->id == plane_polygon_map[i][0]->id)
-						continue;
-					bool same_normal = true;
-					// Checking coplanarity by checking all points/corners of the polygon in question
-					for (int k = 0; k < one_wall->n.size(); k++) {
-						if ((plane_polygon_map[i][0]->n.at(k) != one_wall->n.at(k)) || (signbit(one_wall->n.at(k)) != signbit(plane_polygon_map[i][0]->n.at(k)))) {
-							same_normal = false;
-							break;
-						}
-					}
-					// If distance from origin different, trivially non-coplanar
-					if (one_wall->d != plane_polygon_map[i][0]->d)
-						same_normal = false;
-					// If distance and normals are coincident, and there is already a wall with these parameters add to already existing plane polygon map entry
-					if (same_normal) {
-						plane_polygon_map[i].push_back(one_wall);
-						one_wall->plane_polygon_map_id = i;
-						break;
-					}
-					// If at end of array and plane does not fit anywhere: make new entry in the plane-polygon map
-					else if (i == plane_polygon_map.size() - 1) {
-						plane_polygon_map.push_back({ one_wall });
-						one_wall->plane_polygon_map_id = i + 1;
-					}
+				const plane_key key = make_plane_key(one_wall, epsilon);
+				// Lowest matching entry wins, like the first match of the former linear search
+				int match = -1;
+				const int reach = epsilon > 0.0 ? 1 : 0;
+				for (int dx = -reach; dx <= reach; ++dx)
+					for (int dy = -reach; dy <= reach; ++dy)
+						for (int dz = -reach; dz <= reach; ++dz)
+							for (int dd = -reach; dd <= reach; ++dd) {
+								auto bucket = buckets.find(plane_key{ { key.k[0] + dx, key.k[1] + dy, key.k[2] + dz, key.k[3] + dd } });
+								if (bucket == buckets.end())
+									continue;
+								for (auto i : bucket->second)
+									if ((match == -1 || i < match) && coplanar(plane_polygon_map[i][0], one_wall, epsilon))
+										match = i;
+							}
+				// If distance and normals are coincident, and there is already a wall with these parameters add to already existing plane polygon map entry
+				if (match != -1) {
+					plane_polygon_map[match].push_back(one_wall);
+					one_wall->plane_polygon_map_id = match;
 				}
+				// Plane does not fit anywhere: make new entry in the plane-polygon map
+				else
+					add_entry(one_wall);
 			}
 			// Request to minimise memory footprint of plane_polygon_map
 			for (auto& i : plane_polygon_map)
@@ -339,8 +1188,67 @@ namespace rts {
 			plane_polygon_map.shrink_to_fit();
 		};
 
+		// Plane of a wall quantised to epsilon (or its exact bit pattern for epsilon = 0)
+		struct plane_key {
+			int64_t k[4];
+			bool operator==(const plane_key& other) const { return std::equal(k, k + 4, other.k); }
+		};
+
+		struct plane_key_hash {
+			size_t operator()(const plane_key& key) const {
+				uint64_t h = 1469598103934665603ull;
+				for (auto i : key.k)
+					h = (h ^ (uint64_t)i) * 1099511628211ull;
+				return (size_t)h;
+			}
+		};
+
+		static plane_key make_plane_key(const rts::wall* one_wall, const double epsilon) {
+			const double values[4] = { (double)one_wall->n.at(0), (double)one_wall->n.at(1), (double)one_wall->n.at(2), (double)one_wall->d };
+			plane_key key;
+			for (int k = 0; k < 4; k++) {
+				if (epsilon > 0.0)
+					key.k[k] = (int64_t)std::floor(values[k] / epsilon);
+				else
+					std::memcpy(&key.k[k], &values[k], sizeof(double));
+			}
+			return key;
+		}
+
+		static bool coplanar(const rts::wall* a, const rts::wall* b, const double epsilon) {
+			// Checking coplanarity by comparing normals and distances from origin
+			for (int k = 0; k < 3; k++) {
+				if (std::abs((double)a->n.at(k) - (double)b->n.at(k)) > epsilon || (epsilon == 0.0 && std::signbit(a->n.at(k)) != std::signbit(b->n.at(k))))
+					return false;
+			}
+			return std::abs((double)a->d - (double)b->d) <= epsilon;
+		}
+
 		// [...]
 
+		/*
+		* Coplanar merge of source_walls into merged_walls / merged_into if merge is set, and the parent_walls the fragments
+		* refer to: the merged polygon for input walls merged with others, the input wall itself otherwise
+		*/
+		void merge_source_walls(const bool merge, const double epsilon) {
+			merged_walls.clear();
+			merged_into.clear();
+			parent_walls = walls;
+			if (!merge)
+				return;
+			merged_walls = merge_coplanar_walls(source_walls, epsilon, &merged_into);
+			std::vector<uint32_t> members(walls.size(), 0);
+			for (auto i : merged_into)
+				members[i]++;
+			std::vector<rts::wall*> merged_wall_of(walls.size(), nullptr);
+			for (auto& i : merged_walls)
+				if (i.id < walls.size() && members[i.id] > 1)
+					merged_wall_of[i.id] = &i;
+			for (size_t i = 0; i < walls.size(); ++i)
+				if (merged_wall_of[merged_into[i]])
+					parent_walls[i] = merged_wall_of[merged_into[i]];
+		}
+
 		// translating .obj data into polygonal model of the spatial partitioning code
 		std::vector<PolygonSpatial*> construct_polygonspatial_model(std::vector<rts::wall> polygons) {
 			std::vector<PolygonSpatial*> polygonVec;
@@ -351,7 +1259,7 @@ namespace rts {
 						Point myPoint = Point(i.corners[j][0], i.corners[j][1], i.corners[j][2]);
 						pointVec.push_back(myPoint);
 					}
-					polygonVec.push_back(new PolygonSpatial(pointVec, (int)i.id, i.n.at(0), i.n.at(1), i.n.at(2), i.d));
+					polygonVec.push_back(arena.create<PolygonSpatial>(pointVec, (int)i.id, i.n.at(0), i.n.at(1), i.n.at(2), i.d));
 				}
 			}
 			return polygonVec;
@@ -359,7 +1267,6 @@ namespace rts {
 
 		std::vector<rts::wall*> construct_rtswall_model(std::vector<PolygonSpatial*> polygons) {
 			std::vector<rts::wall*> wall_model;
-			int id = 0;
 			for (auto& i : polygons) {
 				// Construct vector of arma:vecs
 				std::vector<arma::fvec3> arma_vecs;
@@ -370,24 +1277,779 @@ namespace rts {
 					arma_vecs.push_back(arma::fvec3{ endEdge->srcPoint().x(), endEdge->srcPoint().y(), endEdge->srcPoint().z() });
 					endEdge = endEdge->next();
 				}
-				const unsigned int myID = (i->m_parentID * 10000 + id);
+				// Provisional, set_up_room_model assigns the final IDs once all fragments exist
+				const unsigned int myID = (unsigned int)i->m_parentID;
 				// We force load these walls, since mostly numeric inaccuracies occur, which are not relevant to the validity of the geometry
 				// Also, sometimes the usual wall calculation of the normal vectors are faulty, when edges are flipped/inserted by the spatial partitioning algorithm
 				// In any case, we use the parent planes orientation, see below
-				rts::wall* myWall = new rts::wall{ myID, arma_vecs, walls[i->m_parentID]->material, true, true };
+				rts::wall* myWall = arena.create<rts::wall>(myID, arma_vecs, walls[i->m_parentID]->material, true, true);
 				
 				// The usual normal derivation algorithm by the spatial partitioning algorithm can be wonky, so we force to use the parents normal in all cases
 				myWall->n = walls[i->m_parentID]->n;
 				myWall->double_n = walls[i->m_parentID]->double_n;
 				myWall->d = walls[i->m_parentID]->d;
 				myWall->setParentID(i->m_parentID);
-				myWall->setParent(walls[i->m_parentID]);
+				myWall->setParent(parent_walls[i->m_parentID]);
 				wall_model.push_back(myWall);
 				i++;
 			}
 			return wall_model;
 		};
 
+		/*
+		* Dense wall indices and the fragments of each input wall, post-pass of set_up_room_model
+		*/
+		void index_walls() {
+			wall_index.clear();
+			wall_index.reserve(pwalls_BSP.size());
+			for (size_t i = 0; i < pwalls_BSP.size(); ++i)
+				wall_index[pwalls_BSP[i]] = (uint32_t)i;
+			// Counting sort by parent, fragments keep their pwalls_BSP order
+			parent_fragment_offsets.assign(walls.size() + 1, 0);
+			for (auto j : pwalls_BSP)
+				parent_fragment_offsets[j->parent_id + 1]++;
+			for (size_t p = 0; p < walls.size(); ++p)
+				parent_fragment_offsets[p + 1] += parent_fragment_offsets[p];
+			parent_fragments.resize(pwalls_BSP.size());
+			std::vector<uint32_t> next(parent_fragment_offsets.begin(), parent_fragment_offsets.end() - 1);
+			for (size_t i = 0; i < pwalls_BSP.size(); ++i)
+				parent_fragments[next[pwalls_BSP[i]->parent_id]++] = (uint32_t)i;
+			wall_uids.resize(pwalls_BSP.size());
+			for (size_t p = 0; p < walls.size(); ++p)
+				for (uint32_t k = parent_fragment_offsets[p]; k < parent_fragment_offsets[p + 1]; ++k)
+					wall_uids[parent_fragments[k]] = make_wall_uid((uint32_t)p, k - parent_fragment_offsets[p]);
+		}
+
+		/*!
+			Wall with the given rts::wall::id, nullptr if there is none. For parents split into more than WALL_ID_FRAGMENTS
+			fragments the ID is ambiguous and this returns the wall of the lowest parent; use wall_by_uid for those
+		*/
+		rts::wall* wall_by_id(const unsigned int id) const {
+			return wall_by_uid(make_wall_uid(id / WALL_ID_FRAGMENTS, id % WALL_ID_FRAGMENTS));
+		}
+
+		wall_uid wall_uid_of(const rts::wall* one_wall) const {
+			return wall_uids[wall_index.at(one_wall)];
+		}
+
+		// Wall with the given hierarchical ID, nullptr if there is none
+		rts::wall* wall_by_uid(const wall_uid uid) const {
+			const uint32_t parent = wall_uid_parent(uid), fragment = wall_uid_fragment(uid);
+			if (parent >= walls.size() || fragment >= parent_fragment_offsets[parent + 1] - parent_fragment_offsets[parent])
+				return nullptr;
+			return pwalls_BSP[parent_fragments[parent_fragment_offsets[parent] + fragment]];
+		}
+
+		/*
+		* Runtime enabled mask and per plane counts from the enabled flags of the walls
+		*/
+		void init_wall_enabled_state() {
+			wall_state_changes.fetch_add(1);
+			wall_enabled_mask = std::vector<std::atomic<uint64_t>>((pwalls_BSP.size() + 63) / 64);
+			for (size_t i = 0; i < pwalls_BSP.size(); ++i)
+				if (pwalls_BSP[i]->enabled)
+					wall_enabled_mask[i / 64] |= uint64_t(1) << (i % 64);
+			plane_slots.assign(pwalls_BSP.size(), 0);
+			for (auto& i : plane_polygon_map)
+				for (size_t k = 0; k < i.size(); ++k)
+					plane_slots[wall_index.at(i[k])] = (uint32_t)k;
+			plane_enabled_count = std::vector<std::atomic<uint32_t>>(plane_polygon_map.size());
+			plane_representative = std::vector<std::atomic<uint32_t>>(plane_polygon_map.size());
+			for (size_t p = 0; p < plane_polygon_map.size(); ++p)
+				update_plane_enabled_state(p);
+		}
+
+		bool is_wall_enabled(const uint32_t index) const {
+			return (wall_enabled_mask[index / 64].load(std::memory_order_relaxed) >> (index % 64)) & 1;
+		}
+
+		bool is_wall_enabled(const rts::wall* one_wall) const {
+			auto index = wall_index.find(one_wall);
+			return index != wall_index.end() && is_wall_enabled(index->second);
+		}
+
+		// Changes whenever a wall is enabled or disabled, for caches of results that depend on the enabled walls
+		uint64_t wall_state_generation() const {
+			return wall_state_changes.load();
+		}
+
+		// Whether a plane-polygon map entry still has an enabled wall, i.e. can produce image sources
+		bool is_plane_enabled(const size_t plane_id) const {
+			return plane_enabled_count[plane_id].load(std::memory_order_relaxed) != 0;
+		}
+
+		// First enabled wall of a plane-polygon map entry, nullptr if the entry has none
+		const rts::wall* plane_representative_wall(const size_t plane_id) const {
+			return plane_enabled_count[plane_id].load(std::memory_order_relaxed) ? plane_polygon_map[plane_id][plane_representative[plane_id].load(std::memory_order_relaxed)] : nullptr;
+		}
+
+		/*!
+			Enable or disable a wall (dense pwalls_BSP index) at runtime, e.g. to open a door, without rebuilding the BSP.
+			O(1), except for disabling the representative of a plane-polygon map entry, which looks for the next enabled
+			wall of the entry. Safe on a model other threads are querying (e.g. one published through room_model_handle) and
+			from several threads: the mask words change with one atomic OR / AND, calls are serialised by wall_state_mutex.
+			Queries see each wall either enabled or disabled, and a plane's representative may lag a concurrent toggle by one
+			call; the enabled flags of the walls themselves are only meant for single-threaded users.
+		*/
+		void set_wall_enabled(const uint32_t index, const bool enabled) {
+			std::lock_guard<std::mutex> lock(wall_state_mutex);
+			const uint64_t bit = uint64_t(1) << (index % 64);
+			const uint64_t previous = enabled ? wall_enabled_mask[index / 64].fetch_or(bit) : wall_enabled_mask[index / 64].fetch_and(~bit);
+			if (((previous & bit) != 0) == enabled)
+				return;
+			wall_state_changes.fetch_add(1);
+			pwalls_BSP[index]->enabled = enabled;
+			walls_BSP[index].enabled = enabled;
+			const int plane_id = pwalls_BSP[index]->plane_polygon_map_id;
+			if (plane_id < 0 || plane_id >= (int)plane_polygon_map.size() || plane_polygon_map[plane_id][plane_slots[index]] != pwalls_BSP[index])
+				return;
+			const uint32_t slot = plane_slots[index];
+			if (enabled) {
+				if (plane_enabled_count[plane_id]++ == 0 || slot < plane_representative[plane_id])
+					plane_representative[plane_id] = slot;
+			}
+			else if (--plane_enabled_count[plane_id] != 0 && slot == plane_representative[plane_id]) {
+				// The walls before the representative are all disabled, the next enabled one comes after it
+				const std::vector<rts::wall*>& entry = plane_polygon_map[plane_id];
+				uint32_t k = slot + 1;
+				while (!is_wall_enabled(wall_index.at(entry[k])))
+					++k;
+				plane_representative[plane_id] = k;
+			}
+		}
+
+		/*
+		* Enable or disable all fragments of an input wall (index into walls). An input wall merged into a larger polygon
+		* (BSPBuildOptions::merge_coplanar) switches the fragments of that polygon, i.e. all input walls merged into it
+		*/
+		void set_parent_wall_enabled(const uint32_t parent_id, const bool enabled) {
+			const uint32_t parent = merged_into.empty() ? parent_id : merged_into[parent_id];
+			for (uint32_t k = parent_fragment_offsets[parent]; k < parent_fragment_offsets[parent + 1]; ++k)
+				set_wall_enabled(parent_fragments[k], enabled);
+		}
+
+		void update_plane_enabled_state(const size_t plane_id) {
+			const std::vector<rts::wall*>& entry = plane_polygon_map[plane_id];
+			uint32_t count = 0;
+			uint32_t representative = 0;
+			for (size_t k = entry.size(); k-- > 0;) {
+				if (is_wall_enabled(entry[k])) {
+					count++;
+					representative = (uint32_t)k;
+				}
+			}
+			plane_enabled_count[plane_id] = count;
+			plane_representative[plane_id] = representative;
+		}
+
+		// Calls f(wall) for the enabled walls of a node of the flattened tree
+		template <typename F>
+		void for_each_enabled_node_wall(const FlatBSPNode& node, F f) const {
+			for (uint32_t k = 0; k < node.wall_count; ++k) {
+				const uint32_t index = flat_bsp_wall_indices[node.wall_offset + k];
+				if (is_wall_enabled(index))
+					f(pwalls_BSP[index]);
+			}
+		}
+
+		// Calls f(wall) for the enabled blockables of one_wall
+		template <typename F>
+		void for_each_enabled_blockable(const rts::wall* one_wall, F f) const {
+			if (blockable_sets.empty())
+				for_each_enabled(one_wall->blockables, f);
+			else
+				for_each_enabled(blockable_sets[wall_index.at(one_wall)], f);
+		}
+
+		// Calls f(wall) for the enabled direct_reflectables of one_wall
+		template <typename F>
+		void for_each_enabled_reflectable(const rts::wall* one_wall, F f) const {
+			if (reflectable_sets.empty())
+				for_each_enabled(one_wall->direct_reflectables, f);
+			else
+				for_each_enabled(reflectable_sets[wall_index.at(one_wall)], f);
+		}
+
+		// Calls f(wall) for the walls of list that are BSP walls and enabled, one wall_index lookup each
+		template <typename F>
+		void for_each_enabled(const std::vector<rts::wall*>& list, F f) const {
+			for (auto j : list)
+				if (is_wall_enabled(j))
+					f(j);
+		}
+
+		// Calls f(wall) for the walls of set that are enabled, set AND enabled mask one word at a time
+		template <typename F>
+		void for_each_enabled(const wall_bitset& set, F f) const {
+			const uint64_t* words = set.data();
+			for (size_t w = 0; w < set.word_count() && w < wall_enabled_mask.size(); ++w) {
+				for (uint64_t bits = words[w] & wall_enabled_mask[w].load(std::memory_order_relaxed); bits; bits &= bits - 1)
+					f(pwalls_BSP[w * 64 + detail::lowest_bit(bits)]);
+			}
+		}
+
+		// The bitset if the room has them, the list otherwise
+		wall_set_view<rts::wall> reflectables_of(const rts::wall* one_wall) const {
+			if (reflectable_sets.empty())
+				return wall_set_view<rts::wall>(one_wall->direct_reflectables, pwalls_BSP.data());
+			return wall_set_view<rts::wall>(reflectable_sets[wall_index.at(one_wall)], pwalls_BSP.data());
+		}
+
+		wall_set_view<rts::wall> blockables_of(const rts::wall* one_wall) const {
+			if (blockable_sets.empty())
+				return wall_set_view<rts::wall>(one_wall->blockables, pwalls_BSP.data());
+			return wall_set_view<rts::wall>(blockable_sets[wall_index.at(one_wall)], pwalls_BSP.data());
+		}
+
+		// direct_reflectables united over all walls of a plane-polygon map entry. Stored with the first wall of the entry,
+		// but valid for the whole plane whichever of its walls are enabled
+		wall_set_view<rts::wall> plane_reflectables(const size_t plane_id) const {
+			return reflectables_of(plane_polygon_map[plane_id][0]);
+		}
+
+		// Calls f(wall) for the enabled walls of plane_reflectables(plane_id)
+		template <typename F>
+		void for_each_enabled_plane_reflectable(const size_t plane_id, F f) const {
+			for_each_enabled_reflectable(plane_polygon_map[plane_id][0], f);
+		}
+
+		/*!
+			Narrow phase of update_blockable_walls_spatial: whether blocker can block a path between tester and the single
+			wall in tester.direct_reflectables, evaluated by update_blockable_walls on just these two walls. Both are
+			scratch copies, so the walls of the room keep their state; blocker has no direct_reflectables and so adds
+			nothing but the pair test.
+		*/
+		static bool blocks_reflection(rts::wall& tester, rts::wall& blocker, std::vector<rts::wall*>& pair) {
+			pair.assign({ &tester, &blocker });
+			tester.blockables.clear();
+			update_blockable_walls(&pair);
+			return !tester.blockables.empty();
+		}
+
+		/*
+		* Blockables of the walls of list like update_blockable_walls(&list), with a uniform grid over the wall bounding boxes
+		* as broad phase. A wall b can only block a path between wall a and one of its direct_reflectables r if it reaches
+		* into the convex hull of a and r, so its box overlaps the box of a and r. Every (a, r) pair tests only the walls of
+		* the grid cells of that box with blocks_reflection; the blockables of a are the union over its pairs, in list order.
+		* Only the blockables of the walls of list change. Counts the pair tests and those of the full pass (every other wall
+		* per pair) into blockable_pair_tests and blockable_pair_tests_exhaustive; see blockable_mismatches.
+		*/
+		void update_blockable_walls_spatial(std::vector<rts::wall*>& list) {
+			const size_t n = list.size();
+			if (n == 0)
+				return;
+			struct box {
+				float lo[3], hi[3];
+			};
+			auto box_of = [](const rts::wall* w) {
+				box b = { { INFINITY, INFINITY, INFINITY }, { -INFINITY, -INFINITY, -INFINITY } };
+				for (auto& j : w->corners) {
+					for (int k = 0; k < 3; ++k) {
+						b.lo[k] = std::min(b.lo[k], (float)j[k]);
+						b.hi[k] = std::max(b.hi[k], (float)j[k]);
+					}
+				}
+				return b;
+			};
+			std::unordered_map<const rts::wall*, uint32_t> list_index;
+			list_index.reserve(n);
+			std::vector<box> boxes(n);
+			box room_box = { { INFINITY, INFINITY, INFINITY }, { -INFINITY, -INFINITY, -INFINITY } };
+			for (size_t i = 0; i < n; ++i) {
+				list_index.emplace(list[i], (uint32_t)i);
+				boxes[i] = box_of(list[i]);
+				for (int k = 0; k < 3; ++k) {
+					room_box.lo[k] = std::min(room_box.lo[k], boxes[i].lo[k]);
+					room_box.hi[k] = std::max(room_box.hi[k], boxes[i].hi[k]);
+				}
+			}
+
+			// About one wall per cell; cells hold the walls whose box overlaps them, as offset lists
+			const int resolution = std::max(1, std::min(64, (int)std::cbrt((double)n)));
+			float cell_size[3];
+			for (int k = 0; k < 3; ++k)
+				cell_size[k] = std::max((room_box.hi[k] - room_box.lo[k]) / resolution, 1e-6f);
+			auto cell_range = [&](const float* lo, const float* hi, int* first, int* last) {
+				for (int k = 0; k < 3; ++k) {
+					first[k] = std::max(0, std::min(resolution - 1, (int)((lo[k] - room_box.lo[k]) / cell_size[k])));
+					last[k] = std::max(0, std::min(resolution - 1, (int)((hi[k] - room_box.lo[k]) / cell_size[k])));
+				}
+			};
+			auto for_each_cell = [&](const float* lo, const float* hi, auto f) {
+				int first[3], last[3];
+				cell_range(lo, hi, first, last);
+				for (int x = first[0]; x <= last[0]; ++x)
+					for (int y = first[1]; y <= last[1]; ++y)
+						for (int z = first[2]; z <= last[2]; ++z)
+							f(((size_t)x * resolution + y) * resolution + z);
+			};
+			const size_t grid_cell_count = (size_t)resolution * resolution * resolution;
+			std::vector<uint32_t> cell_offsets(grid_cell_count + 1, 0);
+			for (size_t i = 0; i < n; ++i)
+				for_each_cell(boxes[i].lo, boxes[i].hi, [&](size_t c) { cell_offsets[c + 1]++; });
+			for (size_t c = 0; c < grid_cell_count; ++c)
+				cell_offsets[c + 1] += cell_offsets[c];
+			std::vector<uint32_t> cell_walls(cell_offsets.back());
+			std::vector<uint32_t> next(cell_offsets.begin(), cell_offsets.end() - 1);
+			for (size_t i = 0; i < n; ++i)
+				for_each_cell(boxes[i].lo, boxes[i].hi, [&](size_t c) { cell_walls[next[c]++] = (uint32_t)i; });
+
+			// Blockers as copies without direct_reflectables, see blocks_reflection
+			std::vector<rts::wall> blockers;
+			blockers.reserve(n);
+			for (auto j : list) {
+				blockers.push_back(*j);
+				blockers.back().direct_reflectables.clear();
+				blockers.back().blockables.clear();
+			}
+			size_t tests = 0, exhaustive = 0;
+			// visited[b] == pair: b was a candidate of the current (a, r) pair; blocking[b] == a + 1: b is a blockable of a
+			std::vector<size_t> visited(n, 0);
+			std::vector<uint32_t> blocking(n, 0);
+			std::vector<uint32_t> found;
+			std::vector<rts::wall*> pair;
+			std::vector<std::vector<rts::wall*>> blockables(n);
+			size_t pair_id = 0;
+			for (uint32_t a = 0; a < n; ++a) {
+				const rts::wall* one_wall = list[a];
+				rts::wall tester = *one_wall;
+				found.clear();
+				for (auto r : one_wall->direct_reflectables) {
+					++pair_id;
+					visited[a] = pair_id;
+					auto r_index = list_index.find(r);
+					if (r_index != list_index.end())
+						visited[r_index->second] = pair_id;
+					const box r_box = r_index != list_index.end() ? boxes[r_index->second] : box_of(r);
+					box hull;
+					for (int k = 0; k < 3; ++k) {
+						hull.lo[k] = std::min(boxes[a].lo[k], r_box.lo[k]);
+						hull.hi[k] = std::max(boxes[a].hi[k], r_box.hi[k]);
+					}
+					tester.direct_reflectables.assign(1, r);
+					for_each_cell(hull.lo, hull.hi, [&](size_t c) {
+						for (uint32_t k = cell_offsets[c]; k < cell_offsets[c + 1]; ++k) {
+							const uint32_t b = cell_walls[k];
+							if (visited[b] == pair_id)
+								continue;
+							visited[b] = pair_id;
+							bool overlaps = true;
+							for (int d = 0; d < 3; ++d)
+								overlaps &= boxes[b].lo[d] <= hull.hi[d] && boxes[b].hi[d] >= hull.lo[d];
+							// Walls already found for an earlier pair of a need no test
+							if (!overlaps || blocking[b] == a + 1)
+								continue;
+							++tests;
+							if (blocks_reflection(tester, blockers[b], pair)) {
+								blocking[b] = a + 1;
+								found.push_back(b);
+							}
+						}
+					});
+				}
+				std::sort(found.begin(), found.end());
+				for (auto b : found)
+					blockables[a].push_back(list[b]);
+				exhaustive += one_wall->direct_reflectables.size() * (n - 1);
+			}
+			for (size_t i = 0; i < n; ++i)
+				list[i]->blockables = std::move(blockables[i]);
+			blockable_pair_tests += tests;
+			blockable_pair_tests_exhaustive += exhaustive;
+		}
+
+		/*!
+			Recompute the blockables of pwalls_BSP with update_blockable_walls(&pwalls_BSP) and count the walls whose list
+			differs from the current one; the current lists are kept. Checks update_blockable_walls_spatial on a room.
+		*/
+		size_t blockable_mismatches() {
+			std::vector<std::vector<rts::wall*>> current(pwalls_BSP.size());
+			for (size_t i = 0; i < pwalls_BSP.size(); ++i)
+				current[i] = pwalls_BSP[i]->blockables;
+			update_blockable_walls(&pwalls_BSP);
+			size_t mismatches = 0;
+			for (size_t i = 0; i < pwalls_BSP.size(); ++i) {
+				mismatches += pwalls_BSP[i]->blockables != current[i];
+				pwalls_BSP[i]->blockables = std::move(current[i]);
+			}
+			return mismatches;
+		}
+
+		/*
+		* Bitsets of the direct_reflectables and blockables lists of pwalls_BSP (BSPBuildOptions::wall_bitsets), after the
+		* union of the plane-polygon map entries. Walls outside pwalls_BSP cannot be represented, they stay in the lists only
+		* and are counted in a warning
+		*/
+		void build_wall_sets() {
+			const size_t n = pwalls_BSP.size();
+			reflectable_sets.assign(n, wall_bitset(n));
+			blockable_sets.assign(n, wall_bitset(n));
+			size_t unindexed = 0;
+			auto fill = [this, &unindexed](const std::vector<rts::wall*>& list, wall_bitset& set) {
+				for (auto j : list) {
+					auto index = wall_index.find(j);
+					if (index != wall_index.end())
+						set.set(index->second);
+					else
+						unindexed++;
+				}
+			};
+			for (size_t i = 0; i < n; ++i) {
+				fill(pwalls_BSP[i]->direct_reflectables, reflectable_sets[i]);
+				fill(pwalls_BSP[i]->blockables, blockable_sets[i]);
+			}
+			if (unindexed)
+				BOOST_LOG_TRIVIAL(warning) << unindexed << " direct_reflectables / blockables entries are not BSP walls and are missing from the wall sets" << std::endl;
+		}
+
+		/*
+		* Build flat_bsp_nodes and flat_bsp_wall_indices from bsp_tree, post-pass of set_up_room_model
+		*/
+		void flatten_BSP() {
+			flat_bsp_nodes.clear();
+			flat_bsp_wall_indices.clear();
+			flat_bsp_wall_indices.reserve(pwalls_BSP.size());
+			if (bsp_tree)
+				flatten_BSP_node(bsp_tree);
+			flat_bsp_nodes.shrink_to_fit();
+		}
+
+		uint32_t flatten_BSP_node(const BSPNode* node) {
+			const uint32_t index = (uint32_t)flat_bsp_nodes.size();
+			flat_bsp_nodes.push_back(FlatBSPNode{ BSP_NULL_INDEX, BSP_NULL_INDEX, (uint32_t)flat_bsp_wall_indices.size(), (uint32_t)node->node_walls.size(), node->leaf_node });
+			for (auto i : node->node_walls)
+				flat_bsp_wall_indices.push_back(wall_index.at(i));
+			// Children are appended after the walls of this node; index, not reference, since the vector grows
+			if (node->front)
+				flat_bsp_nodes[index].front = flatten_BSP_node(node->front);
+			if (node->back)
+				flat_bsp_nodes[index].back = flatten_BSP_node(node->back);
+			return index;
+		}
+
+		/*
+		* Pack node planes, wall planes and corners for the visibility kernels, post-pass after flatten_BSP
+		*/
+		void build_query_geometry() {
+			query_geometry.clear();
+			query_geometry.node_planes.assign(4 * flat_bsp_nodes.size(), Scalar(0));
+			for (size_t i = 0; i < flat_bsp_nodes.size(); ++i) {
+				// Interior nodes hold the walls of their splitting plane, so the first one defines it
+				if (flat_bsp_nodes[i].leaf_node || flat_bsp_nodes[i].wall_count == 0)
+					continue;
+				const rts::wall* splitter = flat_node_wall(flat_bsp_nodes[i], 0);
+				for (int k = 0; k < 3; ++k)
+					query_geometry.node_planes[4 * i + k] = wall_normal(splitter, k);
+				query_geometry.node_planes[4 * i + 3] = wall_plane_offset(splitter);
+			}
+			size_t corner_count = 0;
+			for (auto i : pwalls_BSP)
+				corner_count += i->corners.size();
+			query_geometry.reserve(pwalls_BSP.size(), corner_count);
+			for (auto i : pwalls_BSP) {
+				query_geometry.add_wall(wall_normal(i, 0), wall_normal(i, 1), wall_normal(i, 2), wall_plane_offset(i));
+				for (auto& j : i->corners)
+					query_geometry.add_corner((Scalar)j[0], (Scalar)j[1], (Scalar)j[2]);
+			}
+		}
+
+		/*!
+			Zero-copy Armadillo view of one axis (0 = x, 1 = y, 2 = z) of the corners of the wall with dense index, for code
+			that still works on Armadillo vectors. Points into query_geometry and is mutable: writes change the geometry the
+			visibility queries use (not the walls or the PVS). Valid until the next build.
+		*/
+		arma::Col<Scalar> wall_corner_view(const uint32_t index, const int axis) {
+			const uint32_t first = query_geometry.corner_offsets[index];
+			return soa_view(axis == 0 ? query_geometry.corner_x : axis == 1 ? query_geometry.corner_y : query_geometry.corner_z, first, query_geometry.corner_offsets[index + 1] - first);
+		}
+
+		// Same for component 0 - 2 of the normals or 3, the plane offsets, of all walls by dense index, also mutable
+		arma::Col<Scalar> wall_plane_view(const int component) {
+			aligned_vector<Scalar>& values = component == 0 ? query_geometry.normal_x : component == 1 ? query_geometry.normal_y : component == 2 ? query_geometry.normal_z : query_geometry.plane_d;
+			return soa_view(values, 0, values.size());
+		}
+
+		static arma::Col<Scalar> soa_view(aligned_vector<Scalar>& values, const size_t first, const size_t count) {
+			// strict keeps the view from ever reallocating or detaching from values
+			return arma::Col<Scalar>(values.data() + first, count, false, true);
+		}
+
+		// Normal component k of a wall in query precision, double queries take the double precision normal
+		static Scalar wall_normal(const rts::wall* one_wall, const int k) {
+			return std::is_same<Scalar, double>::value ? (Scalar)one_wall->double_n.at(k) : (Scalar)one_wall->n.at(k);
+		}
+
+		// Plane offset of a wall in query precision. Double queries do not widen the float d: it is recomputed in double
+		// from the double normal and the first corner of the input wall, which share the plane of all its fragments
+		Scalar wall_plane_offset(const rts::wall* one_wall) const {
+			if (!std::is_same<Scalar, double>::value || one_wall->parent_id >= walls.size() || walls[one_wall->parent_id]->corners.empty())
+				return (Scalar)one_wall->d;
+			const auto& corner = walls[one_wall->parent_id]->corners[0];
+			return (Scalar)-(one_wall->double_n.at(0) * (double)corner[0] + one_wall->double_n.at(1) * (double)corner[1] + one_wall->double_n.at(2) * (double)corner[2]);
+		}
+
+		// Returned by first_blocking_walls for segments no enabled wall blocks
+		static constexpr wall_uid NO_BLOCKING_WALL = ~wall_uid(0);
+
+		/*!
+			First enabled wall hit by each of count segments, traced through the flattened tree in packets of
+			BSP_PACKET_SIZE. Hits within BSP_QUERY_EPSILON of either end are ignored, so paths ending on a wall are not blocked by it.
+			Makes no heap allocation, safe to call from the audio thread. Returns false (blockers untouched) if stack is not
+			reserved for this room (reserve_traversal_stack).
+
+			/param starts, ends
+			count points each, x y z interleaved
+			/param blockers
+			Output, wall_uid of the closest blocking wall per segment or NO_BLOCKING_WALL
+			/param stack
+			Scratch of the calling thread, reserved for this room
+		*/
+		bool first_blocking_walls(const Scalar* starts, const Scalar* ends, const size_t count, wall_uid* blockers, basic_bsp_traversal_stack<Scalar>& stack) const {
+			return trace_segments(starts, ends, count, stack, [this, blockers](const size_t segment, const uint32_t index) {
+				blockers[segment] = index == BSP_NULL_INDEX ? NO_BLOCKING_WALL : wall_uids[index];
+			});
+		}
+
+		// Whether stack is large enough for traversals of this room
+		bool traversal_stack_reserved(const basic_bsp_traversal_stack<Scalar>& stack) const {
+			return stack.capacity() > (size_t)std::max(bsp_tree_height, 0);
+		}
+
+		/*!
+			Calls f(segment, index) with the dense index of the first blocking wall of every segment, BSP_NULL_INDEX if none.
+			Returns false without calling f if stack is not reserved for this room.
+		*/
+		template <typename F>
+		bool trace_segments(const Scalar* starts, const Scalar* ends, const size_t count, basic_bsp_traversal_stack<Scalar>& stack, F f) const {
+			const no_allocation_scope no_allocation;
+			if (!flat_bsp_nodes.empty() && !traversal_stack_reserved(stack))
+				return false;
+			const basic_bsp_query_view<Scalar> view{ flat_bsp_nodes.data(), flat_bsp_wall_indices.data(), &query_geometry, wall_enabled_mask.data() };
+			for (size_t first = 0; first < count; first += BSP_PACKET_SIZE) {
+				const size_t lanes = std::min(BSP_PACKET_SIZE, count - first);
+				basic_bsp_packet<Scalar> packet;
+				for (size_t lane = 0; lane < BSP_PACKET_SIZE; ++lane) {
+					// Unused lanes repeat the last segment and stay masked off
+					const size_t segment = first + std::min(lane, lanes - 1);
+					for (int k = 0; k < 3; ++k) {
+						packet.start[k][lane] = starts[3 * segment + k];
+						packet.end[k][lane] = ends[3 * segment + k];
+					}
+					packet.best_t[lane] = Scalar(1);
+					packet.best_wall[lane] = BSP_NULL_INDEX;
+				}
+				if (!flat_bsp_nodes.empty() && !trace_packet(view, 0, (1u << lanes) - 1, packet, stack))
+					return false;
+				for (size_t lane = 0; lane < lanes; ++lane)
+					f(first + lane, packet.best_wall[lane]);
+			}
+			return true;
+		}
+
+		/*
+		* Number the cells of the flattened tree, post-pass after flatten_BSP
+		*/
+		void build_cells() {
+			cell_count = assign_bsp_cells(flat_bsp_nodes, node_cells);
+		}
+
+		/*
+		* Portals, potentially visible set and the cells in front of every wall, optional post-pass after build_cells.
+		* Skipped with a warning for more than max_cells cells
+		*/
+		void build_pvs(const size_t step_budget, const size_t max_cells) {
+			if (cell_count > max_cells) {
+				BOOST_LOG_TRIVIAL(warning) << "PVS skipped: " << cell_count << " cells exceed BSPBuildOptions::pvs_max_cells = " << max_cells
+					<< ", it would take " << ((size_t)cell_count * cell_count / 8 >> 20) << " MB" << std::endl;
+				return;
+			}
+			basic_bsp_pvs_builder<Scalar> builder(flat_bsp_nodes, flat_bsp_wall_indices, query_geometry, node_cells, cell_count);
+			builder.build_portals();
+			size_t exhausted = 0;
+			cell_pvs = builder.compute_pvs(step_budget, exhausted);
+			build_wall_cells(builder);
+			build_stats.portal_count = builder.portal_list().size();
+			build_stats.pvs_budget_exhausted = exhausted;
+			BOOST_LOG_TRIVIAL(info) << "PVS: " << cell_count << " cells, " << builder.portal_list().size() << " portals, "
+				<< exhausted << " cell(s) over the step budget" << std::endl;
+		}
+
+		void build_wall_cells() {
+			basic_bsp_pvs_builder<Scalar> builder(flat_bsp_nodes, flat_bsp_wall_indices, query_geometry, node_cells, cell_count);
+			build_wall_cells(builder);
+		}
+
+		void build_wall_cells(const basic_bsp_pvs_builder<Scalar>& builder) {
+			std::vector<std::vector<uint32_t>> cells(pwalls_BSP.size());
+			for (uint32_t node = 0; node < flat_bsp_nodes.size(); ++node)
+				for (uint32_t k = 0; k < flat_bsp_nodes[node].wall_count; ++k) {
+					const uint32_t wall = flat_bsp_wall_indices[flat_bsp_nodes[node].wall_offset + k];
+					cells[wall] = builder.wall_front_cells(node, wall);
+				}
+			wall_cell_offsets.assign(1, 0);
+			wall_cells.clear();
+			for (auto& i : cells) {
+				wall_cells.insert(wall_cells.end(), i.begin(), i.end());
+				wall_cell_offsets.push_back((uint32_t)wall_cells.size());
+			}
+		}
+
+		/*!
+			Leaf cell containing point (x y z), found by descending the splitting planes of the flattened tree; points on a
+			plane belong to its front side. Cell IDs are 0 .. cell_count - 1, numbered by assign_bsp_cells from the tree alone,
+			so they stay the same for the same tree, including one loaded from the BSP cache. BSP_NULL_INDEX for an empty room.
+			Makes no heap allocation, safe to call from the audio thread.
+		*/
+		uint32_t locate(const Scalar* point) const {
+			return locate_bsp_cell(flat_bsp_nodes.data(), flat_bsp_nodes.size(), query_geometry.node_planes.data(), node_cells.data(), point[0], point[1], point[2]);
+		}
+
+		uint32_t locate(const arma::fvec3& point) const {
+			const Scalar p[3] = { point[0], point[1], point[2] };
+			return locate(p);
+		}
+
+		/*!
+			Batch version of locate for e.g. all sources of a scene
+
+			/param points
+			count points, x y z interleaved
+			/param cells
+			Output, cell of every point
+		*/
+		void locate(const Scalar* points, const size_t count, uint32_t* cells) const {
+			const no_allocation_scope no_allocation;
+			const FlatBSPNode* nodes = flat_bsp_nodes.data();
+			const Scalar* planes = query_geometry.node_planes.data();
+			const uint32_t* node_cell_ids = node_cells.data();
+			for (size_t i = 0; i < count; ++i)
+				cells[i] = locate_bsp_cell(nodes, flat_bsp_nodes.size(), planes, node_cell_ids, points[3 * i], points[3 * i + 1], points[3 * i + 2]);
+		}
+
+
+		bool has_pvs() const { return !cell_pvs.empty(); }
+
+		size_t pvs_row_words() const { return ((size_t)cell_count + 63) / 64; }
+
+		// False only if no straight line can connect the two cells without passing through a wall; always true without a PVS
+		bool cells_potentially_visible(const uint32_t a, const uint32_t b) const {
+			if (cell_pvs.empty() || a >= cell_count || b >= cell_count)
+				return true;
+			return (cell_pvs[pvs_row_words() * a + b / 64] >> (b % 64)) & 1;
+		}
+
+		// True if any cell of [a, a_end) potentially sees any cell of [b, b_end); an empty range is not known to be hidden
+		bool cells_potentially_visible(const uint32_t* a, const uint32_t* a_end, const uint32_t* b, const uint32_t* b_end) const {
+			if (cell_pvs.empty() || a == a_end || b == b_end)
+				return true;
+			for (const uint32_t* i = a; i != a_end; ++i)
+				for (const uint32_t* j = b; j != b_end; ++j)
+					if (cells_potentially_visible(*i, *j))
+						return true;
+			return false;
+		}
+
+		// Cells bordering the front side of the wall with dense index, empty range without a PVS
+		const uint32_t* wall_cells_begin(const uint32_t index) const {
+			return wall_cell_offsets.empty() ? nullptr : wall_cells.data() + wall_cell_offsets[index];
+		}
+
+		const uint32_t* wall_cells_end(const uint32_t index) const {
+			return wall_cell_offsets.empty() ? nullptr : wall_cells.data() + wall_cell_offsets[index + 1];
+		}
+
+		// Same, with the calling thread's own stack, which reserve_traversal_stack() has to have sized for this room on that thread
+		bool first_blocking_walls(const Scalar* starts, const Scalar* ends, const size_t count, wall_uid* blockers) const {
+			basic_bsp_traversal_stack<Scalar>& stack = thread_traversal_stack();
+			// Never grown here, that would allocate on the real-time thread
+			assert(traversal_stack_reserved(stack) && "call reserve_traversal_stack() on this thread first");
+			return first_blocking_walls(starts, ends, count, blockers, stack);
+		}
+
+		// Size stack for traversals of this room; a stack reserved for the tallest of several rooms works for all of them
+		void reserve_traversal_stack(basic_bsp_traversal_stack<Scalar>& stack) const {
+			stack.reserve(bsp_tree_height);
+		}
+
+		void reserve_traversal_stack() const {
+			reserve_traversal_stack(thread_traversal_stack());
+		}
+
+		static basic_bsp_traversal_stack<Scalar>& thread_traversal_stack() {
+			static thread_local basic_bsp_traversal_stack<Scalar> stack;
+			return stack;
+		}
+
+		// Single segment version of first_blocking_walls
+		bool first_blocking_wall(const arma::fvec3& start, const arma::fvec3& end, wall_uid& blocker) const {
+			const Scalar s[3] = { start[0], start[1], start[2] }, e[3] = { end[0], end[1], end[2] };
+			return first_blocking_walls(s, e, 1, &blocker);
+		}
+
+		/*
+		* Size and shape part of build_stats from the flattened tree, post-pass of set_up_room_model and load_bsp_cache
+		*/
+		void collect_build_stats() {
+			const size_t n = flat_bsp_nodes.size();
+			build_stats.input_polygons = walls.size();
+			build_stats.bsp_walls = pwalls_BSP.size();
+			build_stats.polygon_growth = walls.empty() ? 0.0 : (double)pwalls_BSP.size() / (double)walls.size();
+			build_stats.node_count = n;
+			build_stats.tree_height = bsp_tree_height;
+			build_stats.leaf_count = 0;
+			build_stats.depth_histogram.clear();
+			build_stats.balance_per_level.clear();
+			// Pre-order: children come after their parent, so depths go forward and subtree sizes backward
+			std::vector<uint32_t> depth(n, 0);
+			std::vector<size_t> subtree_walls(n, 0);
+			for (size_t i = 0; i < n; ++i) {
+				for (auto child : { flat_bsp_nodes[i].front, flat_bsp_nodes[i].back })
+					if (child != BSP_NULL_INDEX)
+						depth[child] = depth[i] + 1;
+			}
+			for (size_t i = n; i-- > 0;) {
+				const FlatBSPNode& node = flat_bsp_nodes[i];
+				subtree_walls[i] = node.wall_count + (node.front != BSP_NULL_INDEX ? subtree_walls[node.front] : 0) + (node.back != BSP_NULL_INDEX ? subtree_walls[node.back] : 0);
+			}
+			std::vector<size_t> interior_per_level;
+			for (size_t i = 0; i < n; ++i) {
+				const FlatBSPNode& node = flat_bsp_nodes[i];
+				if (depth[i] >= build_stats.depth_histogram.size()) {
+					build_stats.depth_histogram.resize(depth[i] + 1, 0);
+					build_stats.balance_per_level.resize(depth[i] + 1, 0.0);
+					interior_per_level.resize(depth[i] + 1, 0);
+				}
+				build_stats.depth_histogram[depth[i]]++;
+				if (node.leaf_node) {
+					build_stats.leaf_count++;
+					continue;
+				}
+				const size_t front = node.front != BSP_NULL_INDEX ? subtree_walls[node.front] : 0;
+				const size_t back = node.back != BSP_NULL_INDEX ? subtree_walls[node.back] : 0;
+				build_stats.balance_per_level[depth[i]] += std::max(front, back) ? (double)std::min(front, back) / (double)std::max(front, back) : 1.0;
+				interior_per_level[depth[i]]++;
+			}
+			for (size_t d = 0; d < interior_per_level.size(); ++d)
+				build_stats.balance_per_level[d] = interior_per_level[d] ? build_stats.balance_per_level[d] / (double)interior_per_level[d] : 0.0;
+			build_stats.cell_count = cell_count;
+			size_t visible_pairs = 0;
+			for (auto i : cell_pvs)
+				visible_pairs += detail::bit_count(i);
+			build_stats.pvs_mean_visible = cell_count && has_pvs() ? (double)visible_pairs / ((double)cell_count * (double)cell_count) : 0.0;
+		}
+
+		// Wall k of a node of the flattened tree
+		rts::wall* flat_node_wall(const FlatBSPNode& node, const uint32_t k) const {
+			return pwalls_BSP[flat_bsp_wall_indices[node.wall_offset + k]];
+		}
+
+		// Height of the flattened (sub)tree starting at node
+		int traverseFlatTree(const uint32_t node) const {
+			if (node == BSP_NULL_INDEX)
+				return 0;
+			return std::max(traverseFlatTree(flat_bsp_nodes[node].front), traverseFlatTree(flat_bsp_nodes[node].back)) + 1;
+		}
+
 		int traverseTree(const BSPNode* node) {
 			// Get the height of the tree
 			if (!node)
@@ -448,4 +2110,7 @@ namespace rts {
 #endif // DEBUG
 
 	};
+
+	using room_model = basic_room_model<float>;
+	using room_model_double = basic_room_model<double>;
 }
@@ -0,0 +1,348 @@
+/*
+* Benchmark for room_model::set_up_room_model on synthetic, parametric rooms: shoebox, L-shape, stepped
+* auditorium and a shoebox filled with random box clutter, each generated at several polygon counts (up
+* to 50k). The BuildStats of every build (phase timings, tree shape, splits, polygon growth, Ranta-Eskola
+* fallback rate) are written as JSON so runs can be compared across revisions. With --verify-blockables the
+* blockables of every build are compared with update_blockable_walls(&pwalls_BSP) and the differing walls reported.
+* --verify-classifier compares the scalar, SSE2 and AVX2 classify_polygons paths on random and near-plane polygons
+* and every build's classifications with the whichSide() reference (BuildStats::classifier_mismatches).
+* Every room is built as float and as double model (--precision selects one of them) and a fixed set of
+* random segments is traced through it, to compare the query throughput of both precisions.
+*
+* Usage: room_model_benchmark [--output file.json] [--max-polygons n] [--threshold t] [--parallel]
+*                             [--candidates k] [--sample n] [--spatial-blockables] [--pvs]
+*                             [--merge-coplanar] [--precision float|double|both] [--segments n] [--verify-blockables]
+*                             [--verify-classifier] [--wall-bitsets]
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "room_model.h"
+
+namespace {
+
+	using wall_material = std::remove_cv_t<decltype(rts::wall::material)>;
+
+	// Collects quads; every quad is wound so that its normal is u x v
+	class room_builder {
+	public:
+		std::vector<rts::wall> walls;
+
+		/*!
+			Axis aligned rectangle at coordinate c on axis, spanning [a0, a1] on axis (axis + 1) % 3 and [b0, b1] on
+			axis (axis + 2) % 3, split into a grid of nu * nv quads. normal_sign selects the side the normal points to.
+		*/
+		void add_axis_rect(const int axis, const float c, const float a0, const float a1, const float b0, const float b1, const int normal_sign, const int nu = 1, const int nv = 1) {
+			const int ua = (axis + 1) % 3, va = (axis + 2) % 3;
+			for (int i = 0; i < nu; ++i) {
+				for (int j = 0; j < nv; ++j) {
+					const float u0 = a0 + (a1 - a0) * i / nu, u1 = a0 + (a1 - a0) * (i + 1) / nu;
+					const float v0 = b0 + (b1 - b0) * j / nv, v1 = b0 + (b1 - b0) * (j + 1) / nv;
+					auto point = [&](float u, float v) {
+						arma::fvec3 p{ 0.0f, 0.0f, 0.0f };
+						p[axis] = c;
+						p[ua] = u;
+						p[va] = v;
+						return p;
+					};
+					// e(axis + 1) x e(axis + 2) = e(axis), reverse the winding for the other side
+					std::vector<arma::fvec3> corners{ point(u0, v0), point(u1, v0), point(u1, v1), point(u0, v1) };
+					if (normal_sign < 0)
+						std::swap(corners[1], corners[3]);
+					walls.push_back(rts::wall{ (unsigned int)walls.size(), corners, wall_material(), true, true });
+				}
+			}
+		}
+
+		// Box faces, normals pointing inside (room) or outside (obstacle)
+		void add_box(const float x0, const float y0, const float z0, const float x1, const float y1, const float z1, const bool inward, const int n = 1) {
+			const int s = inward ? 1 : -1;
+			add_axis_rect(0, x0, y0, y1, z0, z1, s, n, n);
+			add_axis_rect(0, x1, y0, y1, z0, z1, -s, n, n);
+			add_axis_rect(1, y0, z0, z1, x0, x1, s, n, n);
+			add_axis_rect(1, y1, z0, z1, x0, x1, -s, n, n);
+			add_axis_rect(2, z0, x0, x1, y0, y1, s, n, n);
+			add_axis_rect(2, z1, x0, x1, y0, y1, -s, n, n);
+		}
+	};
+
+	int subdivision(const size_t target_polygons, const size_t faces) {
+		return std::max(1, (int)std::lround(std::sqrt((double)target_polygons / (double)faces)));
+	}
+
+	std::vector<rts::wall> shoebox(const size_t target_polygons) {
+		room_builder room;
+		room.add_box(0.0f, 0.0f, 0.0f, 20.0f, 12.0f, 8.0f, true, subdivision(target_polygons, 6));
+		return room.walls;
+	}
+
+	std::vector<rts::wall> l_shape(const size_t target_polygons) {
+		room_builder room;
+		const int n = subdivision(target_polygons, 12);
+		const float X = 20.0f, Y = 16.0f, Z = 6.0f, X1 = 10.0f, Y1 = 8.0f;
+		// Floor and ceiling as two rectangles each: [0, X] x [0, Y1] and [0, X1] x [Y1, Y]
+		room.add_axis_rect(2, 0.0f, 0.0f, X, 0.0f, Y1, 1, n, n);
+		room.add_axis_rect(2, 0.0f, 0.0f, X1, Y1, Y, 1, n, n);
+		room.add_axis_rect(2, Z, 0.0f, X, 0.0f, Y1, -1, n, n);
+		room.add_axis_rect(2, Z, 0.0f, X1, Y1, Y, -1, n, n);
+		room.add_axis_rect(0, 0.0f, 0.0f, Y, 0.0f, Z, 1, n, n);
+		room.add_axis_rect(0, X, 0.0f, Y1, 0.0f, Z, -1, n, n);
+		room.add_axis_rect(0, X1, Y1, Y, 0.0f, Z, -1, n, n);
+		room.add_axis_rect(1, 0.0f, 0.0f, Z, 0.0f, X, 1, n, n);
+		room.add_axis_rect(1, Y1, 0.0f, Z, X1, X, -1, n, n);
+		room.add_axis_rect(1, Y, 0.0f, Z, 0.0f, X1, -1, n, n);
+		return room.walls;
+	}
+
+	std::vector<rts::wall> stepped_auditorium(const size_t target_polygons) {
+		room_builder room;
+		const int steps = 20;
+		const float X = 30.0f, Y = 20.0f, Z = 12.0f, tread = X / steps, rise = 0.3f;
+		// Half of the polygons for the step strips (about 4 * steps * n quads), half for the three big n_wall * n_wall walls
+		const int n = std::max(1, (int)(target_polygons / (2 * 4 * steps)));
+		const int n_wall = subdivision(target_polygons / 2, 3);
+		for (int i = 0; i < steps; ++i) {
+			const float x0 = i * tread, x1 = (i + 1) * tread, z = i * rise;
+			room.add_axis_rect(2, z, x0, x1, 0.0f, Y, 1, 1, n);
+			if (i > 0)
+				room.add_axis_rect(0, x0, 0.0f, Y, z - rise, z, -1, n, 1);
+			// Side walls follow the stepped floor
+			room.add_axis_rect(1, 0.0f, z, Z, x0, x1, 1, n, 1);
+			room.add_axis_rect(1, Y, z, Z, x0, x1, -1, n, 1);
+		}
+		room.add_axis_rect(0, 0.0f, 0.0f, Y, 0.0f, Z, 1, n_wall, n_wall);
+		room.add_axis_rect(0, X, 0.0f, Y, (steps - 1) * rise, Z, -1, n_wall, n_wall);
+		room.add_axis_rect(2, Z, 0.0f, X, 0.0f, Y, -1, n_wall, n_wall);
+		return room.walls;
+	}
+
+	std::vector<rts::wall> random_clutter(const size_t target_polygons) {
+		room_builder room;
+		const float X = 40.0f, Y = 30.0f, Z = 10.0f;
+		room.add_box(0.0f, 0.0f, 0.0f, X, Y, Z, true);
+		std::mt19937 rng(4711);
+		std::uniform_real_distribution<float> size(0.2f, 2.0f), unit(0.0f, 1.0f);
+		const size_t boxes = target_polygons > 6 ? (target_polygons - 6) / 6 : 0;
+		for (size_t i = 0; i < boxes; ++i) {
+			const float sx = size(rng), sy = size(rng), sz = size(rng);
+			const float x0 = unit(rng) * (X - sx), y0 = unit(rng) * (Y - sy), z0 = unit(rng) * (Z - sz);
+			room.add_box(x0, y0, z0, x0 + sx, y0 + sy, z0 + sz, false);
+		}
+		return room.walls;
+	}
+
+	struct generator {
+		const char* name;
+		std::vector<rts::wall>(*generate)(size_t);
+	};
+
+	// Segments traced per room and the time they took
+	struct query_result {
+		size_t segments = 0;
+		size_t blocked = 0;
+		double seconds = 0.0;
+	};
+
+	// Trace segment_count random segments between points of the room's bounding box, the same ones for every precision
+	template <typename Model>
+	query_result benchmark_queries(const Model& model, const size_t segment_count) {
+		using scalar = typename Model::scalar_type;
+		query_result result;
+		const auto& g = model.query_geometry;
+		if (g.corner_count() == 0 || segment_count == 0)
+			return result;
+		float lo[3], hi[3];
+		for (int k = 0; k < 3; ++k) {
+			const auto& axis = k == 0 ? g.corner_x : k == 1 ? g.corner_y : g.corner_z;
+			lo[k] = (float)*std::min_element(axis.begin(), axis.end());
+			hi[k] = (float)*std::max_element(axis.begin(), axis.end());
+		}
+		std::mt19937 rng(815);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		std::vector<scalar> starts(3 * segment_count), ends(3 * segment_count);
+		for (size_t i = 0; i < 3 * segment_count; ++i) {
+			starts[i] = lo[i % 3] + unit(rng) * (hi[i % 3] - lo[i % 3]);
+			ends[i] = lo[i % 3] + unit(rng) * (hi[i % 3] - lo[i % 3]);
+		}
+		std::vector<rts::wall_uid> blockers(segment_count);
+		model.reserve_traversal_stack();
+		const auto start = std::chrono::steady_clock::now();
+		if (!model.first_blocking_walls(starts.data(), ends.data(), segment_count, blockers.data()))
+			std::cerr << "Traversal stack not reserved for the room" << std::endl;
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.segments = segment_count;
+		for (auto i : blockers)
+			result.blocked += i != Model::NO_BLOCKING_WALL;
+		return result;
+	}
+
+	template <typename Model>
+	void write_json(std::ostream& out, const char* name, const size_t target, const Model& model, const rts::BSPBuildOptions& options, const double threshold, const query_result& queries, const long long blockable_mismatches) {
+		out << "    {\"generator\": \"" << name << "\", \"target_polygons\": " << target << ", \"polygons\": " << model.walls.size()
+			<< ", \"precision\": \"" << (std::is_same<typename Model::scalar_type, double>::value ? "double" : "float") << "\""
+			<< ", \"threshold\": " << threshold << ", \"parallel\": " << (options.parallel ? "true" : "false")
+			<< ", \"splitter_candidates\": " << options.splitter_candidates << ", \"splitter_sample_size\": " << options.splitter_sample_size
+			<< ", \"spatial_blockables\": " << (options.spatial_blockables ? "true" : "false") << ", \"pvs\": " << (options.compute_pvs ? "true" : "false")
+			<< ", \"merge_coplanar\": " << (options.merge_coplanar ? "true" : "false") << ", \"wall_bitsets\": " << (options.wall_bitsets ? "true" : "false")
+			<< ", \"blockable_mismatches\": " << blockable_mismatches
+			<< ", \"query_segments\": " << queries.segments << ", \"query_blocked\": " << queries.blocked << ", \"query_seconds\": " << queries.seconds << ",\n     \"stats\": ";
+		model.build_stats.write_json(out);
+		out << "}";
+	}
+
+	/*
+	* Polygons whose side differs between the classify_polygons paths, over random planes and polygons of which a part
+	* has vertices at distances around PLANE_SIDE_EPSILON, exactly on it and exactly on the plane
+	*/
+	size_t classifier_path_check(const size_t planes, const size_t polygons) {
+		std::mt19937 rng(4711);
+		std::uniform_real_distribution<double> unit(-1.0, 1.0);
+		std::uniform_int_distribution<int> corners(3, 9);
+		const double eps = rts::PLANE_SIDE_EPSILON;
+		const double near[] = { 0.0, eps, -eps, 0.5 * eps, -0.5 * eps, 2.0 * eps, -2.0 * eps, std::nextafter(eps, 1.0), std::nextafter(-eps, -1.0) };
+		size_t mismatches = 0;
+		rts::polygon_vertex_soa vertices;
+		for (size_t p = 0; p < planes; ++p) {
+			double n[3] = { unit(rng), unit(rng), unit(rng) };
+			const double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			const rts::plane_coefficients plane{ n[0] / length, n[1] / length, n[2] / length, 10.0 * unit(rng) };
+			vertices.clear();
+			for (size_t i = 0; i < polygons; ++i) {
+				const int count = corners(rng);
+				for (int k = 0; k < count; ++k) {
+					double x = 10.0 * unit(rng), y = 10.0 * unit(rng), z = 10.0 * unit(rng);
+					if (i % 2) {
+						// Move the point to a distance of the near list along the normal
+						const double target = near[rng() % (sizeof(near) / sizeof(near[0]))];
+						const double s = plane.a * x + plane.b * y + plane.c * z + plane.d - target;
+						x -= s * plane.a;
+						y -= s * plane.b;
+						z -= s * plane.c;
+					}
+					vertices.add_vertex(x, y, z);
+				}
+				vertices.end_polygon();
+			}
+			mismatches += rts::classifier_path_mismatches(plane, vertices);
+		}
+		return mismatches;
+	}
+
+	// Build one room in the precision of Model, trace the query segments and append its JSON record; blockable_mismatches
+	// is -1 without verify_blockables
+	template <typename Model>
+	void run(std::ostream& out, bool& first, const char* name, const size_t target, std::vector<rts::wall> walls, const rts::BSPBuildOptions& options, const double threshold, const size_t segments, const bool verify_blockables) {
+		Model model;
+		model.set_up_room_model(std::move(walls), threshold, options);
+		const query_result queries = benchmark_queries(model, segments);
+		const long long blockable_mismatches = verify_blockables ? (long long)model.blockable_mismatches() : -1;
+		if (blockable_mismatches > 0)
+			std::cerr << name << ": blockables of " << blockable_mismatches << " walls differ from update_blockable_walls" << std::endl;
+		if (!first)
+			out << ",\n";
+		first = false;
+		write_json(out, name, target, model, options, threshold, queries, blockable_mismatches);
+		std::cout << name << " " << model.walls.size() << " polygons (" << (std::is_same<typename Model::scalar_type, double>::value ? "double" : "float") << "): "
+			<< model.build_stats.timings.total() << " s build, " << queries.seconds << " s for " << queries.segments << " segments" << std::endl;
+	}
+}
+
+int main(int argc, char** argv) {
+	std::string output = "room_model_benchmark.json";
+	size_t max_polygons = 50000;
+	double threshold = 0.5;
+	size_t segments = 100000;
+	bool run_float = true, run_double = true;
+	bool verify_blockables = false;
+	bool verify_classifier = false;
+	rts::BSPBuildOptions options;
+	for (int i = 1; i < argc; ++i) {
+		const bool has_value = i + 1 < argc;
+		if (!std::strcmp(argv[i], "--output") && has_value)
+			output = argv[++i];
+		else if (!std::strcmp(argv[i], "--max-polygons") && has_value)
+			max_polygons = std::strtoull(argv[++i], nullptr, 10);
+		else if (!std::strcmp(argv[i], "--threshold") && has_value)
+			threshold = std::atof(argv[++i]);
+		else if (!std::strcmp(argv[i], "--candidates") && has_value)
+			options.splitter_candidates = std::strtoull(argv[++i], nullptr, 10);
+		else if (!std::strcmp(argv[i], "--sample") && has_value)
+			options.splitter_sample_size = std::strtoull(argv[++i], nullptr, 10);
+		else if (!std::strcmp(argv[i], "--parallel"))
+			options.parallel = true;
+		else if (!std::strcmp(argv[i], "--spatial-blockables"))
+			options.spatial_blockables = true;
+		else if (!std::strcmp(argv[i], "--verify-classifier")) {
+			verify_classifier = true;
+			options.verify_classifier = true;
+		}
+		else if (!std::strcmp(argv[i], "--verify-blockables"))
+			verify_blockables = true;
+		else if (!std::strcmp(argv[i], "--pvs"))
+			options.compute_pvs = true;
+		else if (!std::strcmp(argv[i], "--merge-coplanar"))
+			options.merge_coplanar = true;
+		else if (!std::strcmp(argv[i], "--wall-bitsets"))
+			options.wall_bitsets = true;
+		else if (!std::strcmp(argv[i], "--segments") && has_value)
+			segments = std::strtoull(argv[++i], nullptr, 10);
+		else if (!std::strcmp(argv[i], "--precision") && has_value) {
+			const std::string precision = argv[++i];
+			run_float = precision == "float" || precision == "both";
+			run_double = precision == "double" || precision == "both";
+			if (!run_float && !run_double) {
+				std::cerr << "Unknown precision " << precision << std::endl;
+				return 1;
+			}
+		}
+		else {
+			std::cerr << "Unknown argument " << argv[i] << std::endl;
+			return 1;
+		}
+	}
+
+	const generator generators[] = {
+		{ "shoebox", shoebox },
+		{ "l_shape", l_shape },
+		{ "stepped_auditorium", stepped_auditorium },
+		{ "random_clutter", random_clutter }
+	};
+	const size_t sizes[] = { 100, 1000, 5000, 20000, 50000 };
+
+	std::ofstream out(output);
+	if (!out) {
+		std::cerr << "Cannot write " << output << std::endl;
+		return 1;
+	}
+	out << "{\n";
+	if (verify_classifier) {
+		const size_t mismatches = classifier_path_check(200, 1000);
+		std::cout << "classify_polygons paths: " << mismatches << " mismatches" << std::endl;
+		out << "  \"classifier_path_mismatches\": " << mismatches << ",\n";
+	}
+	out << "  \"runs\": [\n";
+	bool first = true;
+	for (auto& g : generators) {
+		for (auto target : sizes) {
+			if (target > max_polygons)
+				continue;
+			const std::vector<rts::wall> walls = g.generate(target);
+			if (run_float)
+				run<rts::room_model>(out, first, g.name, target, walls, options, threshold, segments, verify_blockables);
+			if (run_double)
+				run<rts::room_model_double>(out, first, g.name, target, walls, options, threshold, segments, verify_blockables);
+		}
+	}
+	out << "\n  ]\n}\n";
+	return 0;
+}
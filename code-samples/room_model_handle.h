@@ -0,0 +1,220 @@
+/*
+* Shared handle to the current room model for the audio thread and the threads rebuilding it. A writer
+* builds a new room_model off the audio thread and publishes it with an atomic pointer swap; readers
+* never take a lock, entering a read costs two atomic stores and a load. Replaced models are retired
+* with the epoch they were swapped out in and freed once every reader that could still see them has
+* left its read (epoch-based reclamation). Published models are not rebuilt in place; their walls can
+* still be enabled and disabled through the handle (set_wall_enabled is safe next to readers). Every
+* published model comes with one traversal stack per reader slot, sized for its tree on the writer's
+* thread, so a taller tree never makes a reader allocate. Templated on the model's scalar type like
+* basic_room_model: room_model_handle and room_model_handle_double.
+*/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "room_model.h"
+
+namespace rts {
+
+	template <typename Scalar>
+	class basic_room_model_handle {
+	public:
+		using room_type = basic_room_model<Scalar>;
+		using traversal_stack_type = basic_bsp_traversal_stack<Scalar>;
+
+	private:
+		static constexpr uint64_t IDLE_EPOCH = UINT64_MAX;
+
+		// One per reader thread, on its own cache line so readers do not contend
+		struct alignas(64) reader_slot {
+			std::atomic<uint64_t> epoch{ IDLE_EPOCH };
+			std::atomic<bool> used{ false };
+		};
+
+		// A published model and the traversal stacks of the reader slots for it
+		struct published_model {
+			std::unique_ptr<room_type> model;
+			std::unique_ptr<traversal_stack_type[]> stacks;
+		};
+
+	public:
+		// Keeps the model it was created with alive until destroyed; one read at a time per reader slot
+		class read_guard {
+		public:
+			read_guard(read_guard&& other) noexcept : slot(other.slot), model(other.model), stack(other.stack) {
+				other.slot = nullptr;
+			}
+
+			~read_guard() {
+				if (slot)
+					slot->epoch.store(IDLE_EPOCH, std::memory_order_release);
+			}
+
+			read_guard(const read_guard&) = delete;
+			read_guard& operator=(const read_guard&) = delete;
+			read_guard& operator=(read_guard&&) = delete;
+
+			// nullptr until the first model is published
+			const room_type* get() const { return model; }
+			const room_type* operator->() const { return model; }
+			const room_type& operator*() const { return *model; }
+			explicit operator bool() const { return model != nullptr; }
+
+			// Traversal stack of this reader slot, reserved for the model's tree (trace_segments, first_blocking_walls)
+			traversal_stack_type& traversal_stack() const { return *stack; }
+
+		private:
+			friend class basic_room_model_handle;
+			read_guard(reader_slot* reader, const published_model* published, const size_t index)
+				: slot(reader), model(published ? published->model.get() : nullptr), stack(published ? &published->stacks[index] : nullptr) {}
+
+			reader_slot* slot;
+			const room_type* model;
+			traversal_stack_type* stack;
+		};
+
+		explicit basic_room_model_handle(const size_t max_readers = 8) : slots(new reader_slot[max_readers]), slot_count(max_readers) {}
+
+		// No reader may be inside a read any more
+		~basic_room_model_handle() {
+			delete current.load();
+			for (auto& i : retired)
+				delete i.second;
+		}
+
+		basic_room_model_handle(const basic_room_model_handle&) = delete;
+		basic_room_model_handle& operator=(const basic_room_model_handle&) = delete;
+
+		/*!
+			Reserve a reader slot for the calling thread, once per thread and outside the real-time path
+
+			/return slot to pass to read()
+		*/
+		size_t register_reader() {
+			for (size_t i = 0; i < slot_count; ++i) {
+				bool expected = false;
+				if (slots[i].used.compare_exchange_strong(expected, true))
+					return i;
+			}
+			throw std::runtime_error("room_model_handle: no free reader slot");
+		}
+
+		void unregister_reader(const size_t reader) {
+			slots[reader].epoch.store(IDLE_EPOCH);
+			slots[reader].used.store(false);
+		}
+
+		/*!
+			Enter a read of the current model, wait-free; the model stays valid until the guard is destroyed
+		*/
+		read_guard read(const size_t reader) const {
+			reader_slot& slot = slots[reader];
+			// Announce the epoch before loading the pointer: a writer that sees the announcement keeps every model retired
+			// in this epoch or later, one that does not has already swapped and this load returns the new model
+			slot.epoch.store(epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+			return read_guard(&slot, current.load(std::memory_order_seq_cst), reader);
+		}
+
+		/*!
+			Make model the current model, retire the previous one and free the retired models no reader can hold any more.
+			Builds should happen before, on the writer's thread; only the swap and the reclamation are serialised.
+		*/
+		void publish(std::unique_ptr<room_type> model) {
+			std::unique_ptr<published_model> published(new published_model());
+			published->stacks.reset(new traversal_stack_type[slot_count]);
+			for (size_t i = 0; i < slot_count; ++i)
+				model->reserve_traversal_stack(published->stacks[i]);
+			published->model = std::move(model);
+			std::lock_guard<std::mutex> lock(writer_mutex);
+			const published_model* previous = current.exchange(published.release(), std::memory_order_seq_cst);
+			const uint64_t retired_epoch = epoch.fetch_add(1, std::memory_order_seq_cst);
+			if (previous)
+				retired.emplace_back(retired_epoch, previous);
+			reclaim();
+		}
+
+		// Build a new model from polygons on the calling thread and publish it
+		void rebuild(std::vector<rts::wall> polygons, const double threshold, const BSPBuildOptions& options = BSPBuildOptions()) {
+			std::unique_ptr<room_type> model(new room_type());
+			model->set_up_room_model(std::move(polygons), threshold, options);
+			publish(std::move(model));
+		}
+
+		/*!
+			Enable or disable a wall (dense index) of the current model while readers use it, see room_model::set_wall_enabled
+
+			/return false if no model is published yet
+		*/
+		bool set_wall_enabled(const uint32_t index, const bool enabled) {
+			std::lock_guard<std::mutex> lock(writer_mutex);
+			published_model* published = current.load(std::memory_order_seq_cst);
+			if (!published)
+				return false;
+			published->model->set_wall_enabled(index, enabled);
+			return true;
+		}
+
+		// Same for all fragments of an input wall, see room_model::set_parent_wall_enabled
+		bool set_parent_wall_enabled(const uint32_t parent_id, const bool enabled) {
+			std::lock_guard<std::mutex> lock(writer_mutex);
+			published_model* published = current.load(std::memory_order_seq_cst);
+			if (!published)
+				return false;
+			published->model->set_parent_wall_enabled(parent_id, enabled);
+			return true;
+		}
+
+		// Free retired models readers have left since the last publish, e.g. from a housekeeping thread; returns the number freed
+		size_t collect() {
+			std::lock_guard<std::mutex> lock(writer_mutex);
+			return reclaim();
+		}
+
+		// Retired models still waiting for readers
+		size_t retired_count() const {
+			std::lock_guard<std::mutex> lock(writer_mutex);
+			return retired.size();
+		}
+
+	private:
+		size_t reclaim() {
+			uint64_t oldest_reader = IDLE_EPOCH;
+			for (size_t i = 0; i < slot_count; ++i)
+				oldest_reader = std::min(oldest_reader, slots[i].epoch.load(std::memory_order_seq_cst));
+			// A reader that announced epoch e may hold any model retired in epoch e or later
+			size_t freed = 0;
+			for (size_t i = 0; i < retired.size();) {
+				if (retired[i].first < oldest_reader) {
+					delete retired[i].second;
+					retired[i] = retired.back();
+					retired.pop_back();
+					freed++;
+				}
+				else
+					++i;
+			}
+			return freed;
+		}
+
+		std::unique_ptr<reader_slot[]> slots;
+		const size_t slot_count;
+		// The writer mutex keeps the current model alive for set_wall_enabled, it is only retired under it
+		std::atomic<published_model*> current{ nullptr };
+		std::atomic<uint64_t> epoch{ 0 };
+		// Serialises writers only, readers never touch it
+		mutable std::mutex writer_mutex;
+		std::vector<std::pair<uint64_t, const published_model*>> retired;
+	};
+
+	using room_model_handle = basic_room_model_handle<float>;
+	using room_model_handle_double = basic_room_model_handle<double>;
+}
@@ -0,0 +1,107 @@
+/*
+* Debug check that code meant for the real-time audio thread does not touch the heap. Exactly one
+* translation unit defines RTS_REPLACE_OPERATOR_NEW before including this header; that replaces the
+* global operator new (plain, array, nothrow and the std::align_val_t overloads aligned_vector uses) with
+* versions counting allocations per thread. no_allocation_scope then asserts
+* in _DEBUG builds that the count did not change while it was alive. Without the replacement the
+* counter stays 0 and the check is a no-op, release builds compile it away entirely.
+*/
+
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace rts {
+
+	// Heap allocations made by the calling thread since it started (only counted with RTS_REPLACE_OPERATOR_NEW)
+	inline size_t& thread_allocation_count() {
+		static thread_local size_t count = 0;
+		return count;
+	}
+
+	class no_allocation_scope {
+	public:
+#ifdef _DEBUG
+		no_allocation_scope() : start(thread_allocation_count()) {}
+		~no_allocation_scope() {
+			assert(thread_allocation_count() == start && "heap allocation on a real-time path");
+		}
+	private:
+		const size_t start;
+#else
+		no_allocation_scope() {}
+#endif
+	public:
+		no_allocation_scope(const no_allocation_scope&) = delete;
+		no_allocation_scope& operator=(const no_allocation_scope&) = delete;
+	};
+}
+
+#ifdef RTS_REPLACE_OPERATOR_NEW
+void* operator new(std::size_t size) {
+	rts::thread_allocation_count()++;
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+	return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+	rts::thread_allocation_count()++;
+	return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept {
+	return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+// Over-aligned allocations, e.g. aligned_allocator of flat_bsp.h
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+	rts::thread_allocation_count()++;
+	const std::size_t align = static_cast<std::size_t>(alignment);
+#ifdef _WIN32
+	return _aligned_malloc(size ? size : 1, align);
+#else
+	// aligned_alloc wants a size that is a multiple of the alignment
+	return std::aligned_alloc(align, ((size ? size : 1) + align - 1) / align * align);
+#endif
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+	if (void* p = operator new(size, alignment, std::nothrow))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+	return operator new(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t& tag) noexcept {
+	return operator new(size, alignment, tag);
+}
+
+#ifdef _WIN32
+void operator delete(void* p, std::align_val_t) noexcept { _aligned_free(p); }
+#else
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+#endif
+void operator delete[](void* p, std::align_val_t alignment) noexcept { operator delete(p, alignment); }
+void operator delete(void* p, std::size_t, std::align_val_t alignment) noexcept { operator delete(p, alignment); }
+void operator delete[](void* p, std::size_t, std::align_val_t alignment) noexcept { operator delete(p, alignment); }
+void operator delete(void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept { operator delete(p, alignment); }
+void operator delete[](void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept { operator delete(p, alignment); }
+#endif
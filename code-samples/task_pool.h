@@ -0,0 +1,181 @@
+/*
+* A small work-stealing task pool used to build independent subtrees of the BSP tree concurrently.
+* Every worker owns a deque: it pushes and pops its own tasks at the back and steals from the front
+* of the other workers' deques once it runs dry. Threads waiting for a task_group keep executing
+* queued tasks instead of blocking, so nested fork/join (as used by the recursive BSP construction)
+* cannot starve the pool.
+*/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace rts {
+
+	class task_pool {
+	public:
+		// Fork/join scope: counts the outstanding tasks and keeps the first exception thrown by any of them
+		class task_group {
+			friend class task_pool;
+			std::atomic<size_t> pending{ 0 };
+			std::exception_ptr error;
+			std::mutex error_mutex;
+		};
+
+		explicit task_pool(unsigned int thread_count = 0) {
+			if (thread_count == 0)
+				thread_count = std::max(1u, std::thread::hardware_concurrency());
+			worker_count = thread_count;
+			queues.reset(new worker_queue[worker_count]);
+			for (unsigned int i = 0; i < worker_count; ++i)
+				workers.emplace_back([this, i]() { worker_loop(i); });
+		}
+
+		~task_pool() {
+			{
+				std::lock_guard<std::mutex> lock(sleep_mutex);
+				stopping = true;
+			}
+			sleep_cv.notify_all();
+			for (auto& i : workers)
+				i.join();
+		}
+
+		task_pool(const task_pool&) = delete;
+		task_pool& operator=(const task_pool&) = delete;
+
+		unsigned int size() const { return worker_count; }
+
+		/*!
+			Queue a task belonging to group. Called from a worker the task lands on that worker's own deque,
+			otherwise the deques are filled round robin.
+		*/
+		template <typename F>
+		void run(task_group& group, F&& f) {
+			group.pending.fetch_add(1, std::memory_order_relaxed);
+			unsigned int target = (current_pool() == this) ? current_index() : next_queue.fetch_add(1, std::memory_order_relaxed) % worker_count;
+			{
+				std::lock_guard<std::mutex> lock(queues[target].mutex);
+				queues[target].tasks.push_back(task{ std::function<void()>(std::forward<F>(f)), &group });
+			}
+			queued.fetch_add(1, std::memory_order_release);
+			sleep_cv.notify_one();
+		}
+
+		/*!
+			Block until every task of group has finished, executing queued tasks in the meantime.
+			Rethrows the first exception raised by a task of the group.
+		*/
+		void wait(task_group& group) {
+			while (group.pending.load(std::memory_order_acquire) != 0) {
+				if (!try_run_one())
+					std::this_thread::yield();
+			}
+			if (group.error)
+				std::rethrow_exception(group.error);
+		}
+
+	private:
+		struct task {
+			std::function<void()> fn;
+			task_group* group;
+		};
+
+		struct worker_queue {
+			std::mutex mutex;
+			std::deque<task> tasks;
+		};
+
+		static task_pool*& current_pool() {
+			static thread_local task_pool* pool = nullptr;
+			return pool;
+		}
+
+		static unsigned int& current_index() {
+			static thread_local unsigned int index = 0;
+			return index;
+		}
+
+		bool try_pop(unsigned int index, task& out, bool steal) {
+			std::lock_guard<std::mutex> lock(queues[index].mutex);
+			if (queues[index].tasks.empty())
+				return false;
+			// Owners work LIFO on their own deque (depth first, cache warm), thieves take the oldest and thus largest subtree
+			if (steal) {
+				out = std::move(queues[index].tasks.front());
+				queues[index].tasks.pop_front();
+			}
+			else {
+				out = std::move(queues[index].tasks.back());
+				queues[index].tasks.pop_back();
+			}
+			queued.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		bool try_run_one() {
+			task t;
+			bool own = current_pool() == this;
+			unsigned int start = own ? current_index() : 0;
+			if (own && try_pop(start, t, false)) {
+				execute(t);
+				return true;
+			}
+			for (unsigned int i = 0; i < worker_count; ++i) {
+				unsigned int victim = (start + i + (own ? 1 : 0)) % worker_count;
+				if (try_pop(victim, t, true)) {
+					execute(t);
+					return true;
+				}
+			}
+			return false;
+		}
+
+		static void execute(task& t) {
+			try {
+				t.fn();
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(t.group->error_mutex);
+				if (!t.group->error)
+					t.group->error = std::current_exception();
+			}
+			t.group->pending.fetch_sub(1, std::memory_order_acq_rel);
+		}
+
+		void worker_loop(unsigned int index) {
+			current_pool() = this;
+			current_index() = index;
+			while (true) {
+				if (try_run_one())
+					continue;
+				std::unique_lock<std::mutex> lock(sleep_mutex);
+				if (stopping)
+					return;
+				// Timed wait: a notify may race with the empty check above, the timeout bounds the cost of missing it
+				sleep_cv.wait_for(lock, std::chrono::milliseconds(1), [this]() { return stopping || queued.load(std::memory_order_acquire) > 0; });
+				if (stopping && queued.load(std::memory_order_acquire) == 0)
+					return;
+			}
+		}
+
+		unsigned int worker_count = 0;
+		std::unique_ptr<worker_queue[]> queues;
+		std::vector<std::thread> workers;
+		std::atomic<size_t> queued{ 0 };
+		std::atomic<unsigned int> next_queue{ 0 };
+		std::mutex sleep_mutex;
+		std::condition_variable sleep_cv;
+		bool stopping = false;
+	};
+}
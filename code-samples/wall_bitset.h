@@ -0,0 +1,231 @@
+/*
+* Dynamic bitset over dense wall indices (positions in room_model::pwalls_BSP), the compact form of the
+* per-wall direct_reflectables and blockables: one bit per wall of the room, unions and intersections
+* are word-wise OR / AND, membership is a single bit test. Iterating yields the indices of the set
+* bits in increasing order; wall_set_view turns them back into rts::wall pointers for code written
+* against the std::vector<rts::wall*> lists.
+*/
+
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace rts {
+
+	namespace detail {
+		inline uint32_t lowest_bit(const uint64_t word) {
+#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward64(&index, word);
+			return (uint32_t)index;
+#else
+			return (uint32_t)__builtin_ctzll(word);
+#endif
+		}
+
+		inline size_t bit_count(const uint64_t word) {
+#if defined(_MSC_VER)
+			return (size_t)__popcnt64(word);
+#else
+			return (size_t)__builtin_popcountll(word);
+#endif
+		}
+	}
+
+	class wall_bitset {
+	public:
+		// Forward iterator over the indices of the set bits
+		class iterator {
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = uint32_t;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const uint32_t*;
+			using reference = uint32_t;
+
+			iterator(const uint64_t* bits, const size_t count, const size_t first) : words(bits), word_count(count), word(first) {
+				current = word < word_count ? words[word] : 0;
+				skip_empty();
+			}
+
+			uint32_t operator*() const { return (uint32_t)(word * 64) + detail::lowest_bit(current); }
+
+			iterator& operator++() {
+				current &= current - 1;
+				skip_empty();
+				return *this;
+			}
+
+			iterator operator++(int) {
+				iterator previous = *this;
+				++*this;
+				return previous;
+			}
+
+			bool operator==(const iterator& other) const { return word == other.word && current == other.current; }
+			bool operator!=(const iterator& other) const { return !(*this == other); }
+
+		private:
+			void skip_empty() {
+				while (!current && word < word_count) {
+					if (++word < word_count)
+						current = words[word];
+				}
+			}
+
+			const uint64_t* words;
+			size_t word_count;
+			size_t word;
+			uint64_t current;
+		};
+
+		wall_bitset() = default;
+		explicit wall_bitset(const size_t size) : bits(size), words((size + 63) / 64, 0) {}
+
+		// Number of walls the set can hold, not the number of set bits
+		size_t size() const { return bits; }
+
+		void resize(const size_t size) {
+			bits = size;
+			words.resize((size + 63) / 64, 0);
+			// Drop bits beyond the new size, so count() and iteration stay within it
+			if (bits % 64 && !words.empty())
+				words.back() &= (uint64_t(1) << (bits % 64)) - 1;
+		}
+
+		void set(const uint32_t index) { words[index / 64] |= uint64_t(1) << (index % 64); }
+		void reset(const uint32_t index) { words[index / 64] &= ~(uint64_t(1) << (index % 64)); }
+		bool test(const uint32_t index) const { return (words[index / 64] >> (index % 64)) & 1; }
+
+		// Clear all bits, keeping the size
+		void clear() {
+			for (auto& i : words)
+				i = 0;
+		}
+
+		size_t count() const {
+			size_t result = 0;
+			for (auto i : words)
+				result += detail::bit_count(i);
+			return result;
+		}
+
+		bool any() const {
+			for (auto i : words)
+				if (i)
+					return true;
+			return false;
+		}
+
+		// Sets of different sizes combine over the shorter one's words
+		wall_bitset& operator|=(const wall_bitset& other) {
+			const size_t n = std::min(words.size(), other.words.size());
+			for (size_t i = 0; i < n; ++i)
+				words[i] |= other.words[i];
+			return *this;
+		}
+
+		wall_bitset& operator&=(const wall_bitset& other) {
+			const size_t n = std::min(words.size(), other.words.size());
+			for (size_t i = 0; i < n; ++i)
+				words[i] &= other.words[i];
+			for (size_t i = n; i < words.size(); ++i)
+				words[i] = 0;
+			return *this;
+		}
+
+		friend wall_bitset operator|(wall_bitset a, const wall_bitset& b) { return a |= b; }
+		friend wall_bitset operator&(wall_bitset a, const wall_bitset& b) { return a &= b; }
+
+		bool intersects(const wall_bitset& other) const {
+			const size_t n = std::min(words.size(), other.words.size());
+			for (size_t i = 0; i < n; ++i)
+				if (words[i] & other.words[i])
+					return true;
+			return false;
+		}
+
+		const uint64_t* data() const { return words.data(); }
+		size_t word_count() const { return words.size(); }
+
+		iterator begin() const { return iterator(words.data(), words.size(), 0); }
+		iterator end() const { return iterator(words.data(), words.size(), words.size()); }
+
+		// Bytes held by the words, for memory statistics
+		size_t memory_bytes() const { return words.capacity() * sizeof(uint64_t); }
+
+	private:
+		size_t bits = 0;
+		std::vector<uint64_t> words;
+	};
+
+	/*!
+		Range over the walls of a wall_bitset, behaves like iterating a std::vector<Wall*> in wall index order. Can also
+		wrap such a list directly, for rooms built without the bitsets (BSPBuildOptions::wall_bitsets)
+
+		/param walls
+		Walls by dense index, i.e. pwalls_BSP.data()
+	*/
+	template <typename Wall>
+	class wall_set_view {
+	public:
+		class iterator {
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = Wall*;
+			using difference_type = std::ptrdiff_t;
+			using pointer = Wall* const*;
+			using reference = Wall*;
+
+			iterator(const wall_bitset::iterator position, Wall* const* wall_table) : bit(position), walls(wall_table), entry(nullptr) {}
+			explicit iterator(Wall* const* list_entry) : bit(nullptr, 0, 0), walls(nullptr), entry(list_entry) {}
+
+			Wall* operator*() const { return entry ? *entry : walls[*bit]; }
+			iterator& operator++() {
+				if (entry)
+					++entry;
+				else
+					++bit;
+				return *this;
+			}
+			iterator operator++(int) {
+				iterator previous = *this;
+				++*this;
+				return previous;
+			}
+			bool operator==(const iterator& other) const { return entry == other.entry && bit == other.bit; }
+			bool operator!=(const iterator& other) const { return !(*this == other); }
+
+		private:
+			wall_bitset::iterator bit;
+			Wall* const* walls;
+			// Position in the wrapped list, null when iterating a bitset
+			Wall* const* entry;
+		};
+
+		wall_set_view(const wall_bitset& bits, Wall* const* wall_table) : set(&bits), list(nullptr), walls(wall_table) {}
+		wall_set_view(const std::vector<Wall*>& entries, Wall* const* wall_table) : set(nullptr), list(&entries), walls(wall_table) {}
+
+		iterator begin() const { return set ? iterator(set->begin(), walls) : iterator(list->data()); }
+		iterator end() const { return set ? iterator(set->end(), walls) : iterator(list->data() + list->size()); }
+		size_t size() const { return set ? set->count() : list->size(); }
+		bool empty() const { return set ? !set->any() : list->empty(); }
+		bool contains(const uint32_t index) const {
+			if (set)
+				return index < set->size() && set->test(index);
+			return std::find(list->begin(), list->end(), walls[index]) != list->end();
+		}
+
+	private:
+		const wall_bitset* set;
+		const std::vector<Wall*>* list;
+		Wall* const* walls;
+	};
+}